@@ -0,0 +1,183 @@
+/*
+ * Asynchronous I/O Engine Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <marten/aio.h>
+
+#define BLOCK_SIZE	512
+#define BLOCK_COUNT	300	/* more than one submission ring	*/
+
+static struct aio req[BLOCK_COUNT + 1], *list[BLOCK_COUNT + 1];
+static char data[BLOCK_COUNT][BLOCK_SIZE];
+
+static void prep (int fd, int op, size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i) {
+		memset (req + i, 0, sizeof (req[i]));
+
+		req[i].aio_fildes     = fd;
+		req[i].aio_lio_opcode = op;
+		req[i].aio_buf        = data[i % BLOCK_COUNT];
+		req[i].aio_nbytes     = BLOCK_SIZE;
+		req[i].aio_offset     = (off_t) i * BLOCK_SIZE;
+		req[i].aio_sigevent.sigev_notify = SIGEV_NONE;
+
+		list[i] = req + i;
+	}
+}
+
+static int submit (size_t n)
+{
+	if (aio_submit (list, n) == n)
+		return 1;
+
+	perror ("E: submit");
+	return 0;
+}
+
+static int join (size_t n)
+{
+	size_t i;
+	int ok = 1;
+
+	for (i = 0; i < n; ++i)
+		if (aio_join (req + i) != BLOCK_SIZE) {
+			fprintf (stderr, "E: request %zu failed\n", i);
+			ok = 0;
+		}
+
+	return ok;
+}
+
+static int check (void)
+{
+	size_t i;
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		if (data[i][0] != (char) i ||
+		    memcmp (data[i], data[i] + 1, BLOCK_SIZE - 1) != 0) {
+			fprintf (stderr, "E: block %zu read back corrupted\n", i);
+			return 0;
+		}
+
+	return 1;
+}
+
+/*
+ * One request to closed descriptor in the middle of batch: it fails, but
+ * does not break others
+ */
+static int check_bad_fd (int fd)
+{
+	int bad = dup (fd);
+	size_t i;
+	int ok = 1;
+
+	close (bad);
+	prep (fd, LIO_READ, BLOCK_COUNT);
+	req[BLOCK_COUNT / 2].aio_fildes = bad;
+
+	if (!submit (BLOCK_COUNT))
+		return 0;
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		if ((aio_join (req + i) == BLOCK_SIZE) != (i != BLOCK_COUNT / 2))
+			ok = 0;
+
+	if (!ok)
+		fprintf (stderr, "E: bad request status wrong\n");
+
+	return ok;
+}
+
+static void *feed (void *cookie)
+{
+	const int *fd = cookie;
+
+	usleep (10000);
+	return write (fd[1], "x", 1) == 1 ? NULL : cookie;
+}
+
+/*
+ * Wait without timeout for a read of pipe that completes only after
+ * another thread writes to it
+ */
+static int check_wait (void)
+{
+	const struct aio *v[1] = { req };
+	pthread_t tid;
+	int fd[2], ok;
+
+	if (pipe (fd) != 0)
+		return 0;
+
+	prep (fd[0], LIO_READ, 1);
+
+	if (!(ok = submit (1)))
+		goto out;
+
+	if (pthread_create (&tid, NULL, feed, fd) != 0) {
+		(void) write (fd[1], "x", 1);
+		ok = 0;
+	}
+	else {
+		aio_wait (v, 1, NULL);
+		ok = !aio_pending (req);
+		pthread_join (tid, NULL);
+	}
+
+	ok = aio_join (req) == 1 && ok;
+
+	if (!ok)
+		fprintf (stderr, "E: wait without timeout failed\n");
+out:
+	close (fd[0]);
+	close (fd[1]);
+	return ok;
+}
+
+int main (int argc, char *argv[])
+{
+	const char *path = "aio-test.tmp";
+	size_t i;
+	int fd, ok;
+
+	if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		perror ("E: open");
+		return 1;
+	}
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		memset (data[i], i, BLOCK_SIZE);
+
+	prep (fd, LIO_WRITE, BLOCK_COUNT);
+	ok = submit (BLOCK_COUNT) && join (BLOCK_COUNT);
+
+	memset (data, 0, sizeof (data));
+	prep (fd, LIO_READ, BLOCK_COUNT);
+	ok = ok && submit (BLOCK_COUNT) && join (BLOCK_COUNT) && check ();
+
+	/* single requests and read past the end of file */
+	prep (fd, LIO_READ, BLOCK_COUNT + 1);
+	ok = ok && aio_read (req) == 0 && aio_join (req) == BLOCK_SIZE &&
+	     aio_read (req + BLOCK_COUNT) == 0 &&
+	     aio_join (req + BLOCK_COUNT) == 0 && check_bad_fd (fd) &&
+	     check_wait ();
+
+	close (fd);
+	unlink (path);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,491 @@
+/*
+ * Marten Asynchronous I/O, Linux io_uring Backend
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <marten/aio.h>
+
+#ifdef aio_read  /* io_uring backend selected */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <marten/atomic.h>
+#include <marten/bool.h>
+#include <marten/cond.h>
+#include <marten/mutex.h>
+#include <marten/thread.h>
+
+#define AIO_URING_ORDER		8	/* submission ring size order	*/
+#define AIO_URING_REAP		64	/* max completions per pass	*/
+#define AIO_URING_OPS		256	/* max operations to probe	*/
+
+struct aio_ring {
+	int		fd;
+	unsigned	sq_entries, cq_entries;
+	atomic_uint	*sq_head, *sq_tail, *cq_head, *cq_tail;
+	unsigned	*sq_mask, *sq_array, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+
+	mutex_t		sq_lock;	/* serializes submitters	*/
+	mutex_t		lock;		/* protects fields below	*/
+	cond_t		done;		/* some requests completed	*/
+	unsigned	inflight;	/* requests not reaped yet	*/
+};
+
+static struct aio_ring ring = {
+	.sq_lock = MUTEX_INIT,
+	.lock    = MUTEX_INIT,
+	.done    = COND_INIT,
+};
+
+static mutex_t ring_lock = MUTEX_INIT;
+static int ring_state;		/* 0 - not ready, 1 - ring, -1 - POSIX AIO */
+
+static int aio_ring_enter (unsigned submit, unsigned wait, unsigned flags)
+{
+	return syscall (__NR_io_uring_enter, ring.fd, submit, wait, flags,
+			NULL, 0);
+}
+
+static void *aio_ring_map (size_t size, off_t offset)
+{
+	void *p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, offset);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+static struct sigevent aio_complete (struct aio *o, ssize_t res)
+{
+	const struct sigevent ev = o->aio_sigevent;
+
+	o->aio_result = res;
+	atomic_store_explicit (&o->aio_done, 1, memory_order_release);
+	return ev;  /* request may be freed by waiter from now on */
+}
+
+static void aio_notify (const struct sigevent *ev)
+{
+	if (ev->sigev_notify == SIGEV_THREAD)
+		ev->sigev_notify_function (ev->sigev_value);
+}
+
+/*
+ * Reap available completions in batches, wake up all waiters, then run
+ * notification callbacks
+ */
+static void *aio_reaper (void *cookie)
+{
+	struct sigevent ev[AIO_URING_REAP];
+	unsigned head, tail, n, i;
+	struct io_uring_cqe *e;
+
+	for (;;) {
+		head = *ring.cq_head;
+		tail = atomic_load_explicit (ring.cq_tail,
+					     memory_order_acquire);
+
+		if (head == tail) {
+			aio_ring_enter (0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		for (n = 0; head != tail && n < AIO_URING_REAP; ++head, ++n) {
+			e = ring.cqes + (head & *ring.cq_mask);
+			ev[n] = aio_complete ((void *) e->user_data, e->res);
+		}
+
+		atomic_store_explicit (ring.cq_head, head,
+				       memory_order_release);
+
+		mutex_lock (&ring.lock);
+		ring.inflight -= n;
+		cond_broadcast (&ring.done);
+		mutex_unlock (&ring.lock);
+
+		for (i = 0; i < n; ++i)
+			aio_notify (ev + i);
+	}
+
+	return NULL;
+}
+
+static bool aio_ring_op (const struct io_uring_probe *p, unsigned op)
+{
+	return op < p->ops_len && (p->ops[op].flags & IO_URING_OP_SUPPORTED) != 0;
+}
+
+/*
+ * Plain read and write operations are supported since Linux 5.6, as the
+ * probe itself: older kernels fail it and are served by POSIX AIO
+ */
+static bool aio_ring_probe (void)
+{
+	struct io_uring_probe *p;
+	const size_t size = sizeof (*p) + AIO_URING_OPS * sizeof (p->ops[0]);
+	bool ok;
+
+	if ((p = calloc (1, size)) == NULL)
+		return false;
+
+	ok = syscall (__NR_io_uring_register, ring.fd, IORING_REGISTER_PROBE,
+		      p, AIO_URING_OPS) == 0 &&
+	     aio_ring_op (p, IORING_OP_READ) && aio_ring_op (p, IORING_OP_WRITE);
+
+	free (p);
+	return ok;
+}
+
+static bool aio_ring_setup (void)
+{
+	struct io_uring_params p;
+	size_t sq_size, cq_size;
+	void *sq, *cq;
+	thread_t t;
+
+	memset (&p, 0, sizeof (p));
+
+	if ((ring.fd = syscall (__NR_io_uring_setup, 1U << AIO_URING_ORDER,
+				&p)) < 0)
+		return false;
+
+	if (!aio_ring_probe ())
+		goto no_sq;
+
+	sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	cq_size = p.cq_off.cqes  + p.cq_entries * sizeof (ring.cqes[0]);
+
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+	if ((sq = aio_ring_map (sq_size, IORING_OFF_SQ_RING)) == NULL)
+		goto no_sq;
+
+	if ((p.features & IORING_FEAT_SINGLE_MMAP) != 0)
+		cq = sq;
+	else if ((cq = aio_ring_map (cq_size, IORING_OFF_CQ_RING)) == NULL)
+		goto no_cq;
+
+	ring.sqes = aio_ring_map (p.sq_entries * sizeof (ring.sqes[0]),
+				  IORING_OFF_SQES);
+	if (ring.sqes == NULL)
+		goto no_sqes;
+
+	ring.sq_entries = p.sq_entries;
+	ring.sq_head    = sq + p.sq_off.head;
+	ring.sq_tail    = sq + p.sq_off.tail;
+	ring.sq_mask    = sq + p.sq_off.ring_mask;
+	ring.sq_array   = sq + p.sq_off.array;
+
+	ring.cq_entries = p.cq_entries;
+	ring.cq_head    = cq + p.cq_off.head;
+	ring.cq_tail    = cq + p.cq_off.tail;
+	ring.cq_mask    = cq + p.cq_off.ring_mask;
+	ring.cqes       = cq + p.cq_off.cqes;
+
+	if (thread_create (&t, aio_reaper, NULL) && thread_detach (t))
+		return true;
+
+	munmap (ring.sqes, p.sq_entries * sizeof (ring.sqes[0]));
+no_sqes:
+	if (cq != sq)
+		munmap (cq, cq_size);
+no_cq:
+	munmap (sq, sq_size);
+no_sq:
+	close (ring.fd);
+	return false;
+}
+
+static bool aio_ring_ready (void)
+{
+	if (atomic_load_explicit (&ring_state, memory_order_acquire) == 0) {
+		mutex_lock (&ring_lock);
+
+		if (ring_state == 0)
+			atomic_store_explicit (&ring_state,
+					       aio_ring_setup () ? 1 : -1,
+					       memory_order_release);
+
+		mutex_unlock (&ring_lock);
+	}
+
+	return ring_state > 0;
+}
+
+/*
+ * POSIX AIO fallback used when io_uring is not available
+ */
+static struct aiocb *aio_posix_prep (struct aio *o)
+{
+	struct aiocb *cb = &o->aio_cb;
+
+	memset (cb, 0, sizeof (*cb));
+
+	cb->aio_fildes     = o->aio_fildes;
+	cb->aio_lio_opcode = o->aio_lio_opcode;
+	cb->aio_buf        = o->aio_buf;
+	cb->aio_nbytes     = o->aio_nbytes;
+	cb->aio_offset     = o->aio_offset;
+	cb->aio_sigevent   = o->aio_sigevent;
+
+	o->aio_done = 0;
+	return cb;
+}
+
+/*
+ * A failed lio_listio may have queued some of requests already, requests
+ * refused for lack of resources are moved to the tail of list
+ */
+static size_t aio_posix_sort (struct aio *v[], size_t n)
+{
+	const int error = errno;
+	struct aio *o;
+	size_t i, done;
+
+	for (i = 0, done = 0; i < n; ++i)
+		if (aio_error (&v[i]->aio_cb) != EAGAIN) {
+			o = v[done];
+			v[done++] = v[i];
+			v[i] = o;
+		}
+
+	errno = error;
+	return done;
+}
+
+static size_t aio_posix_submit (struct aio *v[], size_t n)
+{
+	struct aiocb *list[AIO_URING_REAP];
+	size_t done, count, queued, i;
+
+	for (done = 0; done < n; done += count) {
+		count = n - done < AIO_URING_REAP ? n - done : AIO_URING_REAP;
+
+		for (i = 0; i < count; ++i)
+			list[i] = aio_posix_prep (v[done + i]);
+
+		/* failed requests that were queued are reported by join */
+		if (lio_listio (LIO_NOWAIT, list, count, NULL) != 0 &&
+		    (queued = aio_posix_sort (v + done, count)) < count)
+			return done + queued;
+	}
+
+	return done;
+}
+
+static ssize_t aio_posix_join (const struct aio *o)
+{
+	const struct aiocb *cb = &o->aio_cb;
+
+	while (aio_error (cb) == EINPROGRESS)
+		aio_suspend (&cb, 1, NULL);
+
+	return aio_return ((void *) cb);
+}
+
+static void aio_ring_prep (struct aio *o)
+{
+	const int op = o->aio_lio_opcode == LIO_READ ? IORING_OP_READ :
+						       IORING_OP_WRITE;
+	const unsigned tail = *ring.sq_tail, i = tail & *ring.sq_mask;
+	struct io_uring_sqe *e = ring.sqes + i;
+
+	memset (e, 0, sizeof (*e));
+
+	e->opcode    = op;
+	e->fd        = o->aio_fildes;
+	e->off       = o->aio_offset;
+	e->addr      = (size_t) o->aio_buf;
+	e->len       = o->aio_nbytes;
+	e->user_data = (size_t) o;
+
+	o->aio_done = 0;
+	ring.sq_array[i] = i;
+	atomic_store_explicit (ring.sq_tail, tail + 1, memory_order_release);
+}
+
+/*
+ * Queue up to sq_entries requests and submit them with one system call,
+ * returns the number of requests submitted. The number of requests in
+ * flight is limited by the completion ring size to never lose completions.
+ * Requests the kernel did not take are removed from the ring.
+ */
+static size_t aio_ring_submit (struct aio *v[], size_t n)
+{
+	const size_t total = n;
+	size_t i;
+	int ret;
+
+	mutex_lock (&ring.lock);
+
+	while (ring.inflight + n > ring.cq_entries)
+		cond_wait (&ring.done, &ring.lock);
+
+	ring.inflight += n;
+	mutex_unlock (&ring.lock);
+
+	mutex_lock (&ring.sq_lock);
+
+	for (i = 0; i < n; ++i)
+		aio_ring_prep (v[i]);
+
+	while (n > 0)
+		if ((ret = aio_ring_enter (n, 0, 0)) >= 0)
+			n -= ret;
+		else if (errno != EINTR && errno != EAGAIN && errno != EBUSY)
+			break;
+
+	if (n > 0)
+		atomic_store_explicit (ring.sq_tail, *ring.sq_tail - n,
+				       memory_order_release);
+
+	mutex_unlock (&ring.sq_lock);
+
+	if (n > 0) {
+		ret = errno;
+
+		mutex_lock (&ring.lock);
+		ring.inflight -= n;
+		cond_broadcast (&ring.done);
+		mutex_unlock (&ring.lock);
+
+		errno = ret;
+	}
+
+	return total - n;
+}
+
+size_t aio_submit (struct aio *v[], size_t n)
+{
+	size_t done, count, ret;
+
+	if (!aio_ring_ready ())
+		return aio_posix_submit (v, n);
+
+	for (done = 0; done < n; done += count) {
+		count = n - done < ring.sq_entries ? n - done : ring.sq_entries;
+
+		if ((ret = aio_ring_submit (v + done, count)) < count)
+			return done + ret;
+	}
+
+	return n;
+}
+
+int aio_read (struct aio *o)
+{
+	o->aio_lio_opcode = LIO_READ;
+	return aio_submit (&o, 1) == 1 ? 0 : -1;
+}
+
+int aio_write (struct aio *o)
+{
+	o->aio_lio_opcode = LIO_WRITE;
+	return aio_submit (&o, 1) == 1 ? 0 : -1;
+}
+
+bool aio_pending (const struct aio *o)
+{
+	if (atomic_load_explicit (&o->aio_done, memory_order_acquire))
+		return false;
+
+	return ring_state > 0 || aio_error (&o->aio_cb) == EINPROGRESS;
+}
+
+static bool aio_ring_any (const struct aio *const v[], size_t n)
+{
+	size_t i;
+
+	for (i = 0; i < n; ++i)
+		if (atomic_load_explicit (&v[i]->aio_done,
+					  memory_order_acquire))
+			return true;
+
+	return false;
+}
+
+static void aio_posix_wait (const struct aio *const v[], size_t n,
+			    const struct timespec *timeout)
+{
+	const struct aiocb *list[AIO_URING_REAP];
+	size_t i;
+
+	if (n > AIO_URING_REAP)
+		n = AIO_URING_REAP;  /* the rest is checked after timeout */
+
+	for (i = 0; i < n; ++i)
+		if (v[i]->aio_done)
+			return;
+		else
+			list[i] = &v[i]->aio_cb;
+
+	(void) aio_suspend (list, n, timeout);
+}
+
+void aio_wait (const struct aio *const v[], size_t n,
+	       const struct timespec *timeout)
+{
+	struct timespec ts;
+
+	if (ring_state < 0) {
+		aio_posix_wait (v, n, timeout);
+		return;
+	}
+
+	if (timeout != NULL) {  /* NULL: wait without timeout */
+		clock_gettime (CLOCK_REALTIME, &ts);
+
+		ts.tv_sec  += timeout->tv_sec;
+		ts.tv_nsec += timeout->tv_nsec;
+
+		if (ts.tv_nsec >= 1000000000L) {
+			++ts.tv_sec;
+			ts.tv_nsec -= 1000000000L;
+		}
+	}
+
+	mutex_lock (&ring.lock);
+
+	while (!aio_ring_any (v, n))
+		if (timeout == NULL)
+			cond_wait (&ring.done, &ring.lock);
+		else if (cond_timedwait (&ring.done, &ring.lock, &ts) != 0)
+			break;
+
+	mutex_unlock (&ring.lock);
+}
+
+ssize_t aio_join (const struct aio *o)
+{
+	if (!atomic_load_explicit (&o->aio_done, memory_order_acquire)) {
+		if (ring_state < 0)
+			return aio_posix_join (o);
+
+		mutex_lock (&ring.lock);
+
+		while (!o->aio_done)
+			cond_wait (&ring.done, &ring.lock);
+
+		mutex_unlock (&ring.lock);
+	}
+
+	if (o->aio_result >= 0)
+		return o->aio_result;
+
+	errno = -o->aio_result;
+	return -1;
+}
+
+#endif  /* aio_read */
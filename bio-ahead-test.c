@@ -0,0 +1,102 @@
+/*
+ * Block Device I/O Read-Ahead Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+
+#include <unistd.h>
+
+#include <marten/bio-cache.h>
+#include <marten/device/block.h>
+
+#define BLOCK_SIZE	4096
+#define BLOCK_COUNT	256
+#define READ_COUNT	8
+
+static int open_file (const char *path)
+{
+	int fd, dev;
+
+	if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+		return -1;
+
+	if (ftruncate (fd, BLOCK_COUNT * BLOCK_SIZE) != 0) {
+		close (fd);
+		return -1;
+	}
+
+	close (fd);
+	dev = dev_block_open (path, 0);
+	unlink (path);
+	return dev;
+}
+
+/*
+ * Return class of cached block without promotion, or -1 if not cached
+ */
+static int cached_class (int dev, unsigned i)
+{
+	struct bio *o;
+	int class;
+
+	if ((o = bio_cache_pull (dev, (off_t) i * BLOCK_SIZE, BLOCK_SIZE,
+				 BIO_CLASS_DATA)) == NULL)
+		return -1;
+
+	class = o->bio_class;
+	bio_put (o);
+	return class;
+}
+
+/*
+ * Sequential scan of pinned blocks: blocks read are pinned, blocks read
+ * ahead of the scan are cached as metadata
+ */
+static int check_pin (int dev)
+{
+	struct bio *o;
+	unsigned i;
+
+	for (i = 0; i < READ_COUNT; ++i) {
+		o = bio_read_class (dev, (off_t) i * BLOCK_SIZE, BLOCK_SIZE,
+				    BIO_PIN);
+		if (o == NULL)
+			return 0;
+
+		bio_read_end (o);
+		bio_put (o);
+	}
+
+	for (i = 0; i < READ_COUNT; ++i)
+		if (cached_class (dev, i) != BIO_CLASS_PIN) {
+			fprintf (stderr, "E: block %u read is not pinned\n", i);
+			return 0;
+		}
+
+	if (cached_class (dev, READ_COUNT) != BIO_CLASS_META) {
+		fprintf (stderr, "E: block read ahead is not metadata\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	int dev, ok;
+
+	if ((dev = open_file ("bio-ahead-test.tmp")) == -1) {
+		perror ("E: open");
+		return 1;
+	}
+
+	ok = check_pin (dev);
+
+	dev_block_close (dev);
+	return ok ? 0 : 1;
+}
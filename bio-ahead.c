@@ -0,0 +1,172 @@
+/*
+ * Block Device I/O Adaptive Read-Ahead
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <marten/bio.h>
+#include <marten/hash.h>
+#include <marten/mutex.h>
+
+#define BIO_AHEAD_ORDER		6		/* stream table order	*/
+#define BIO_AHEAD_BATCH		32		/* max blocks per batch	*/
+#define BIO_AHEAD_MIN		(16UL << 10)	/* initial window	*/
+#define BIO_AHEAD_MAX		(512UL << 10)	/* default max window	*/
+
+#define BIO_AHEAD_SIZE		(1UL << BIO_AHEAD_ORDER)
+
+/*
+ * Sequential streams are detected by the offset where next read of the
+ * stream is expected: every stream is stored in the slot selected by the
+ * hash of device and this offset. A read that continues a stream moves it
+ * to the next slot and grows its window, any other read starts a new
+ * stream candidate in place of an older one. Thus random reads never
+ * trigger read-ahead, and an interrupted stream starts from the minimal
+ * window again.
+ *
+ * Like Linux on-demand read-ahead, the next window is requested when the
+ * reader has consumed a half of the current one, thus I/O is overlapped
+ * with processing of data.
+ */
+struct bio_stream {
+	int	dev;
+	off_t	next;		/* expected offset of next read		*/
+	off_t	ahead;		/* end of already requested range	*/
+	size_t	window;		/* current window size, 0 - candidate	*/
+};
+
+static mutex_t ahead_lock[BIO_AHEAD_SIZE] = {
+	[0 ... BIO_AHEAD_SIZE - 1] = MUTEX_INIT,
+};
+
+static struct bio_stream ahead[BIO_AHEAD_SIZE] = {
+	[0 ... BIO_AHEAD_SIZE - 1] = { .dev = -1 },
+};
+
+static atomic_t ahead_max = BIO_AHEAD_MAX;
+
+static size_t bio_ahead_index (int dev, off_t offset)
+{
+	uint32_t iv = 0;
+
+	iv = oat_hash_step (iv, dev);
+	iv = oat_hash_step (iv, offset);
+	iv = oat_hash_step (iv, offset >> 32);
+
+	return oat_hash_final (iv) & (BIO_AHEAD_SIZE - 1);
+}
+
+static bool bio_stream_take (struct bio_stream *o, int dev, off_t offset)
+{
+	const size_t i = bio_ahead_index (dev, offset);
+	bool found;
+
+	mutex_lock (ahead_lock + i);
+
+	if ((found = ahead[i].dev == dev && ahead[i].next == offset)) {
+		*o = ahead[i];
+		ahead[i].dev = -1;
+	}
+
+	mutex_unlock (ahead_lock + i);
+	return found;
+}
+
+static void bio_stream_put (const struct bio_stream *o)
+{
+	const size_t i = bio_ahead_index (o->dev, o->next);
+
+	mutex_lock (ahead_lock + i);
+	ahead[i] = *o;
+	mutex_unlock (ahead_lock + i);
+}
+
+void bio_prefetch (int dev, off_t from, off_t to, size_t count, int mode)
+{
+	struct bio *v[BIO_AHEAD_BATCH];
+	size_t n, i;
+
+	if (count == 0)
+		return;
+
+	/* speculative blocks never take the pinned budget */
+	if ((mode & BIO_PIN) != 0)
+		mode = (mode & ~BIO_PIN) | BIO_META;
+
+	while (from < to) {
+		for (n = 0; n < BIO_AHEAD_BATCH && from < to; from += count)
+			if ((v[n] = bio_get (dev, from, count, mode)) == NULL)
+				continue;
+			else if (lockword_trywrlock (&v[n]->bio_lock))
+				++n;
+			else
+				bio_put (v[n]);  /* in use, no need to prefetch */
+
+		bio_emit_many (v, n, BIO_R);
+
+		for (i = 0; i < n; ++i) {
+			lockword_unlock (&v[i]->bio_lock);
+			bio_put (v[i]);
+		}
+	}
+}
+
+void bio_ahead (int dev, off_t offset, size_t count, int mode)
+{
+	const size_t max = atomic_load_explicit (&ahead_max,
+						 memory_order_relaxed);
+	struct bio_stream s;
+	off_t from, end;
+	size_t step;
+
+	/* there is nothing to overlap reads of synchronous devices with */
+	if (count == 0 || max < count || !dev_block_async (dev))
+		return;
+
+	if (!bio_stream_take (&s, dev, offset)) {
+		s.dev    = dev;
+		s.next   = offset + count;
+		s.ahead  = s.next;
+		s.window = 0;
+
+		bio_stream_put (&s);
+		return;
+	}
+
+	s.next += count;
+
+	if (s.ahead < s.next)
+		s.ahead = s.next;
+
+	if (s.window == 0)
+		s.window = BIO_AHEAD_MIN > count * 4 ? BIO_AHEAD_MIN : count * 4;
+	else if (s.ahead - s.next <= s.window / 2)
+		s.window *= 2;
+
+	if (s.window > max)
+		s.window = max;
+
+	end = s.next + s.window;
+
+	/* prefetch whole cache units, as bio_get extends requests to them */
+	if (s.ahead - s.next <= s.window / 2) {
+		from = s.ahead;
+		step = count;
+		dev_block_round (dev, &from, &step);
+		end = from + ((end - from) / step) * step;
+
+		if (end > s.ahead) {
+			bio_prefetch (dev, from, end, step, mode);
+			s.ahead = end;
+		}
+	}
+
+	bio_stream_put (&s);
+}
+
+void bio_ahead_limit (size_t max)
+{
+	atomic_store_explicit (&ahead_max, max, memory_order_relaxed);
+}
@@ -0,0 +1,168 @@
+/*
+ * Block Device I/O Completion Queue Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <marten/bio.h>
+#include <marten/bio-cache.h>
+#include <marten/device/block.h>
+
+#define BLOCK_SIZE	4096
+#define BLOCK_COUNT	100
+
+static const char *path = "bio-async-test.tmp";
+static int seen[BLOCK_COUNT];	/* 0 - waiting, 1 - read, -1 - failed */
+
+static void done (void *cookie, struct bio *o)
+{
+	const size_t i = (size_t) cookie;
+	const unsigned char *p;
+
+	if (o == NULL) {
+		seen[i] = -1;
+		return;
+	}
+
+	p = o->bio_data;
+	seen[i] = p[0] == i && memcmp (p, p + 1, BLOCK_SIZE - 1) == 0 ? 1 : -1;
+}
+
+static size_t poll_for (int ms)
+{
+	struct pollfd pfd = { bio_async_fd (), POLLIN };
+
+	if (poll (&pfd, 1, ms) < 0)
+		return 0;
+
+	return bio_async_poll ();
+}
+
+static int wait_for (size_t i, int ms)
+{
+	for (; seen[i] == 0 && ms > 0; ms -= 10)
+		poll_for (10);
+
+	return seen[i];
+}
+
+static int start (int dev, size_t i)
+{
+	return bio_read_async (dev, i * BLOCK_SIZE, BLOCK_SIZE, done,
+			       (void *) i);
+}
+
+static int check_many (int dev)
+{
+	size_t i;
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		if (!start (dev, i))
+			return 0;
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		if (wait_for (i, 5000) != 1) {
+			fprintf (stderr, "E: async read %zu failed\n", i);
+			return 0;
+		}
+
+	return 1;
+}
+
+/*
+ * A read of block held by other thread must not delay completion of later
+ * reads
+ */
+static int check_order (int dev)
+{
+	const size_t a = 1, b = 2;
+	struct bio *o;
+	int ok;
+
+	bio_cache_purge (dev);
+	memset (seen, 0, sizeof (seen));
+
+	/* block a has no data, thus it is not ready until we release it */
+	if ((o = bio_write (dev, a * BLOCK_SIZE, BLOCK_SIZE, 0)) == NULL)
+		return 0;
+
+	ok = start (dev, a) && start (dev, b) && wait_for (b, 5000) == 1 &&
+	     seen[a] == 0;
+
+	if (!ok)
+		fprintf (stderr, "E: async read waits for earlier one\n");
+
+	bio_write_end (o, 0);
+	bio_put (o);
+
+	if (wait_for (a, 5000) != 1) {
+		fprintf (stderr, "E: released block is not read\n");
+		ok = 0;
+	}
+
+	return ok;
+}
+
+/*
+ * Blocks with reads in flight started by prefetch have no notification,
+ * they must complete too
+ */
+static int check_foreign (int dev)
+{
+	size_t i;
+
+	bio_cache_purge (dev);
+	memset (seen, 0, sizeof (seen));
+	bio_prefetch (dev, 0, BLOCK_COUNT * BLOCK_SIZE, BLOCK_SIZE, 0);
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		if (!start (dev, i))
+			return 0;
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		if (wait_for (i, 5000) != 1) {
+			fprintf (stderr, "E: prefetched read %zu failed\n", i);
+			return 0;
+		}
+
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	unsigned char buf[BLOCK_SIZE];
+	size_t i;
+	int fd, dev, ok = 1;
+
+	if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		perror ("E: open");
+		return 1;
+	}
+
+	for (i = 0; i < BLOCK_COUNT && ok; ++i) {
+		memset (buf, i, sizeof (buf));
+		ok = write (fd, buf, sizeof (buf)) == sizeof (buf);
+	}
+
+	close (fd);
+
+	if (ok && (dev = dev_block_open (path, 0)) != -1) {
+		ok = check_many (dev) && check_order (dev) &&
+		     check_foreign (dev);
+		dev_block_close (dev);
+	}
+	else
+		ok = 0;
+
+	unlink (path);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,289 @@
+/*
+ * Block Device I/O Completion Queue
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+#include <marten/bio.h>
+#include <marten/cond.h>
+#include <marten/mutex.h>
+#include <marten/pool.h>
+#include <marten/thread.h>
+
+/*
+ * Reads started by bio_read_async carry completion notification: the AIO
+ * engine moves the request to the done queue from its own thread, and
+ * the done queue is drained by bio_async_poll in the thread of event
+ * loop. Blocks found ready in cache bypass the wait. Blocks with reads
+ * in flight started by others (read-ahead or other readers) have no
+ * notification, they go to the wait queue, and the completion thread
+ * waits for them in order of requests. Every transition to the done
+ * queue signals the event descriptor.
+ */
+struct bio_async {
+	struct bio_async	*next;
+	struct bio		*bio;
+	bio_async_fn		*fn;
+	void			*cookie;
+	bool			ok;
+};
+
+struct bio_async_queue {
+	struct bio_async	*head, **tail;
+};
+
+static mutex_t async_lock = MUTEX_INIT;
+static cond_t  async_cond = COND_INIT;
+static struct bio_async_queue async_wait = { NULL, &async_wait.head };
+static struct bio_async_queue async_done = { NULL, &async_done.head };
+static int async_state;		/* 0 - not started, 1 - run, -1 - fail	*/
+static int async_fd[2] = { -1, -1 };	/* event descriptor: read, write */
+
+static void bio_async_push (struct bio_async_queue *q, struct bio_async *o)
+{
+	o->next = NULL;
+	*q->tail = o;
+	q->tail = &o->next;
+}
+
+static struct bio_async *bio_async_take (struct bio_async_queue *q)
+{
+	struct bio_async *o = q->head;
+
+	q->head = NULL;
+	q->tail = &q->head;
+	return o;
+}
+
+static void bio_async_signal (void)
+{
+	const uint64_t one = 1;
+
+	/* counter overflow or full pipe means event is pending already */
+	(void) write (async_fd[1], &one, async_fd[0] == async_fd[1] ? 8 : 1);
+}
+
+static void bio_async_complete (struct bio_async *o)
+{
+	mutex_lock (&async_lock);
+
+	bio_async_push (&async_done, o);
+	bio_async_signal ();
+
+	mutex_unlock (&async_lock);
+}
+
+static void bio_async_notify (union sigval v)
+{
+	bio_async_complete (v.sival_ptr);
+}
+
+/*
+ * Start read of block with completion notification, the result is picked
+ * up by bio_async_poll
+ */
+static bool bio_async_load (struct bio_async *o)
+{
+	struct bio *b = o->bio;
+	struct sigevent *ev;
+
+	if (bio_req_alloc (b, LIO_READ) == NULL)
+		return false;
+
+	ev = &b->bio_req->aio_sigevent;
+	ev->sigev_notify            = SIGEV_THREAD;
+	ev->sigev_notify_function   = bio_async_notify;
+	ev->sigev_notify_attributes = NULL;
+	ev->sigev_value.sival_ptr   = o;
+
+	if (aio_read (b->bio_req) != 0) {
+		bio_req_free (b);
+		return false;
+	}
+
+	b->bio_state |= BIO_LOAD;
+	return true;
+}
+
+/*
+ * Returns 1 if read is started with notification, 0 if it is finished
+ * already, or -1 if the block is busy with request of others
+ */
+static int bio_async_emit (struct bio_async *o)
+{
+	struct bio *b = o->bio;
+	int ret = 0;
+
+	if (bio_ready (b))
+		return 0;
+
+	if (!lockword_trywrlock (&b->bio_lock))
+		return -1;
+
+	if ((b->bio_state & BIO_READY) != 0)
+		ret = 0;
+	else if ((b->bio_state & BIO_BUSY) != 0)
+		ret = -1;
+	else if (!dev_block_async (b->bio_dev))
+		o->ok = bio_load (b);
+	else if (bio_async_load (o))
+		ret = 1;
+	else
+		o->ok = false;
+
+	lockword_unlock (&b->bio_lock);
+	return ret;
+}
+
+static void *bio_async_worker (void *cookie)
+{
+	struct bio_async *o, *next;
+
+	for (;;) {
+		mutex_lock (&async_lock);
+
+		while (async_wait.head == NULL)
+			cond_wait (&async_cond, &async_lock);
+
+		o = bio_async_take (&async_wait);
+		mutex_unlock (&async_lock);
+
+		for (; o != NULL; o = next) {
+			next = o->next;
+			o->ok = bio_read_begin (o->bio) &&
+				bio_read_end (o->bio);
+			bio_async_complete (o);
+		}
+	}
+
+	return NULL;
+}
+
+static bool bio_async_open (void)
+{
+#ifdef __linux__
+	int fd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+
+	if (fd != -1) {
+		async_fd[0] = async_fd[1] = fd;
+		return true;
+	}
+#endif
+	if (pipe (async_fd) != 0)
+		return false;
+
+	fcntl (async_fd[0], F_SETFL, O_NONBLOCK);
+	fcntl (async_fd[1], F_SETFL, O_NONBLOCK);
+	fcntl (async_fd[0], F_SETFD, FD_CLOEXEC);
+	fcntl (async_fd[1], F_SETFD, FD_CLOEXEC);
+	return true;
+}
+
+static bool bio_async_start (void)
+{
+	thread_t t;
+
+	if (async_state == 0)
+		async_state = bio_async_open () &&
+			      thread_create (&t, bio_async_worker, NULL) &&
+			      thread_detach (t) ? 1 : -1;
+
+	return async_state > 0;
+}
+
+int bio_async_fd (void)
+{
+	bool ok;
+
+	mutex_lock (&async_lock);
+	ok = bio_async_start ();
+	mutex_unlock (&async_lock);
+
+	return ok ? async_fd[0] : -1;
+}
+
+bool bio_read_async (int dev, off_t offset, size_t count,
+		     bio_async_fn *fn, void *cookie)
+{
+	struct bio_async *o;
+	bool ok;
+	int state;
+
+	if ((o = pool_alloc (sizeof (*o))) == NULL)
+		return false;
+
+	if ((o->bio = bio_get (dev, offset, count, 0)) == NULL)
+		goto no_bio;
+
+	bio_ahead (dev, offset, count, 0);
+
+	o->fn     = fn;
+	o->cookie = cookie;
+	o->ok     = true;
+
+	mutex_lock (&async_lock);
+	ok = bio_async_start ();
+	mutex_unlock (&async_lock);
+
+	if (!ok)
+		goto no_start;
+
+	/* emitted outside of queue lock, notification may come at once */
+	if ((state = bio_async_emit (o)) == 0)
+		bio_async_complete (o);
+	else if (state < 0) {
+		mutex_lock (&async_lock);
+		bio_async_push (&async_wait, o);
+		cond_signal (&async_cond);
+		mutex_unlock (&async_lock);
+	}
+
+	return true;
+no_start:
+	bio_put (o->bio);
+no_bio:
+	pool_free (o, sizeof (*o));
+	return false;
+}
+
+size_t bio_async_poll (void)
+{
+	struct bio_async *o, *next;
+	uint64_t event;
+	size_t n;
+
+	mutex_lock (&async_lock);
+
+	if (async_state > 0)
+		while (read (async_fd[0], &event, sizeof (event)) > 0) {}
+
+	o = bio_async_take (&async_done);
+	mutex_unlock (&async_lock);
+
+	for (n = 0; o != NULL; o = next, ++n) {
+		next = o->next;
+
+		if (o->ok && bio_read_begin (o->bio)) {
+			o->fn (o->cookie, o->bio);
+			bio_read_end (o->bio);
+		}
+		else
+			o->fn (o->cookie, NULL);
+
+		bio_put (o->bio);
+		pool_free (o, sizeof (*o));
+	}
+
+	return n;
+}
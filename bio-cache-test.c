@@ -0,0 +1,191 @@
+/*
+ * Block Device I/O Cache Scaling Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <marten/bio-cache.h>
+#include <marten/device/block.h>
+
+#define BLOCK_SIZE	4096
+#define BLOCK_COUNT	4096
+#define LOOKUPS		(1UL << 20)
+
+static int dev;
+
+static double now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int warm_up (void)
+{
+	struct bio *o;
+	size_t i;
+
+	for (i = 0; i < BLOCK_COUNT; ++i) {
+		if ((o = bio_read (dev, i * BLOCK_SIZE, BLOCK_SIZE)) == NULL)
+			return 0;
+
+		bio_read_end (o);
+		bio_put (o);
+	}
+
+	return 1;
+}
+
+static void *worker (void *cookie)
+{
+	unsigned seed = (size_t) cookie;
+	struct bio *o;
+	size_t i;
+	off_t pos;
+
+	for (i = 0; i < LOOKUPS; ++i) {
+		pos = (off_t) (rand_r (&seed) % BLOCK_COUNT) * BLOCK_SIZE;
+
+		if ((o = bio_get (dev, pos, BLOCK_SIZE, 0)) == NULL)
+			return cookie;
+
+		bio_put (o);
+	}
+
+	return NULL;
+}
+
+/*
+ * Threads miss on the same cold blocks at once: all of them must get the
+ * one block cached at the offset
+ */
+#define SHARE_THREADS	4
+#define SHARE_COUNT	1024
+
+static int share_dev;
+static pthread_barrier_t share_start;
+static struct bio *share[SHARE_THREADS][SHARE_COUNT];
+
+static void *share_worker (void *cookie)
+{
+	struct bio **v = cookie;
+	size_t i;
+
+	pthread_barrier_wait (&share_start);
+
+	for (i = 0; i < SHARE_COUNT; ++i)
+		if ((v[i] = bio_read (share_dev, i * BLOCK_SIZE,
+				      BLOCK_SIZE)) != NULL)
+			bio_read_end (v[i]);
+
+	return NULL;
+}
+
+static int check_share (void)
+{
+	pthread_t tid[SHARE_THREADS];
+	FILE *f;
+	size_t i, j;
+	int ok = 1;
+
+	/* file: reads are asynchronous, misses overlap longer */
+	if ((f = tmpfile ()) == NULL)
+		return 0;
+
+	if (ftruncate (fileno (f), SHARE_COUNT * BLOCK_SIZE) != 0) {
+		fclose (f);
+		return 0;
+	}
+
+	share_dev = fileno (f);
+	pthread_barrier_init (&share_start, NULL, SHARE_THREADS);
+
+	for (i = 0; i < SHARE_THREADS; ++i)
+		pthread_create (tid + i, NULL, share_worker, share[i]);
+
+	for (i = 0; i < SHARE_THREADS; ++i)
+		pthread_join (tid[i], NULL);
+
+	for (j = 0; j < SHARE_COUNT; ++j)
+		for (i = 0; i < SHARE_THREADS; ++i) {
+			ok &= share[i][j] != NULL && share[i][j] == share[0][j];
+
+			if (share[i][j] != NULL)
+				bio_put (share[i][j]);
+		}
+
+	if (!ok)
+		fprintf (stderr, "E: concurrent misses got different blocks\n");
+
+	pthread_barrier_destroy (&share_start);
+	fclose (f);
+	return ok;
+}
+
+static int run (size_t threads)
+{
+	pthread_t *tid;
+	void *ret;
+	size_t i;
+	double start, time;
+	int ok = 1;
+
+	if ((tid = calloc (threads, sizeof (tid[0]))) == NULL)
+		return 0;
+
+	start = now ();
+
+	for (i = 0; i < threads; ++i)
+		if (pthread_create (tid + i, NULL, worker, (void *) (i + 1)) != 0)
+			break;
+
+	for (threads = i, i = 0; i < threads; ++i) {
+		pthread_join (tid[i], &ret);
+		ok &= ret == NULL;
+	}
+
+	time = now () - start;
+
+	printf ("%3zu threads: %8.3f Mlookups/s\n",
+		threads, threads * LOOKUPS / time / 1e6);
+
+	free (tid);
+	return ok;
+}
+
+int main (int argc, char *argv[])
+{
+	const size_t max = argc > 1 ? atoi (argv[1]) :
+				      sysconf (_SC_NPROCESSORS_ONLN) * 2;
+	size_t i;
+	int ok;
+
+	if ((dev = dev_block_ram (BLOCK_COUNT * BLOCK_SIZE)) == -1) {
+		perror ("bio-cache-test");
+		return 1;
+	}
+
+	if (!warm_up ()) {
+		fprintf (stderr, "E: Cannot read test blocks\n");
+		return 1;
+	}
+
+	ok = check_share ();
+
+	for (i = 1; i <= max; i *= 2)
+		ok &= run (i);
+
+	dev_block_close (dev);
+	return ok ? 0 : 1;
+}
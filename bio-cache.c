@@ -6,18 +6,79 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <stdlib.h>
+
 #include <marten/bio-cache.h>
 #include <marten/hash.h>
 #include <marten/mutex.h>
 
-#define BIO_CACHE_ORDER		10
-#define BIO_CACHE_SIZE		(1UL << BIO_CACHE_ORDER)
-#define BIO_CACHE_MASK		(BIO_CACHE_SIZE - 1UL)
+#define BIO_CACHE_ORDER		8		/* initial shard table order */
+#define BIO_CACHE_LIMIT		(64UL << 20)	/* default data capacity     */
+#define BIO_CACHE_META		(16UL << 20)	/* default metadata capacity */
+#define BIO_CACHE_PIN		(8UL  << 20)	/* default pinned capacity   */
+#define BIO_CACHE_SHARDS	4		/* log2 of shard count       */
+#define BIO_CACHE_LINE		64		/* cache line size, bytes    */
+#define BIO_CACHE_GHOST		10		/* log2 of ghosts per shard  */
+
+#define BIO_SHARD_COUNT		(1UL << BIO_CACHE_SHARDS)
+#define BIO_GHOST_SIZE		(1UL << BIO_CACHE_GHOST)
+
+#define BIO_PROBE	0	/* probation queue, FIFO	*/
+#define BIO_MAIN	1	/* main queue, CLOCK		*/
+#define BIO_RINGS	(BIO_CLASSES * 2)
+
+/*
+ * The cache is split into shards selected by the hash of device and offset
+ * to let lookups of different blocks proceed in parallel. Every shard is a
+ * chained hash table with its own lock and its own share of the capacity,
+ * shards are aligned to cache lines to avoid false sharing.
+ *
+ * Blocks are split into priority classes (data, metadata and pinned) with
+ * separate budgets, thus streaming of data never evicts metadata. Pinned
+ * blocks are never evicted, when the pinned budget is exhausted new blocks
+ * fall back to metadata class. A hit with higher class promotes the block.
+ *
+ * Replacement within a class follows 2Q to resist one-off scans: new
+ * blocks enter the probation queue, which takes up to a quarter of the
+ * budget and is evicted in FIFO order. Hits on blocks in the younger half
+ * of probation are correlated references (like a scan reading all inodes
+ * of a block) and ignored, blocks re-referenced later are moved to the
+ * main queue when they reach the head of probation. Thus a scan touching
+ * every block once never reaches the main queue. Keys of blocks evicted
+ * from probation are remembered in the direct-mapped ghost table, and a
+ * miss on a ghost key puts the block into the main queue directly.
+ *
+ * The main queue uses CLOCK replacement: a hit sets the reference bit,
+ * the hand clears it and evicts idle blocks that were not referenced
+ * since the previous pass.
+ */
+struct bio_ring {
+	struct bio	*hand;
+	size_t		count, size;
+};
+
+struct bio_shard {
+	mutex_t		lock;
+	struct bio	**table;
+	unsigned	order;
+	size_t		count, tick;		/* tick: insertions	*/
+	struct bio_ring	ring[BIO_RINGS];	/* class * 2 + queue	*/
+	size_t		limit[BIO_CLASSES];
+	uint32_t	*ghost;
+} __attribute__ ((aligned (BIO_CACHE_LINE)));
 
-static mutex_t cache_lock = MUTEX_INIT;
-static struct bio *cache[BIO_CACHE_SIZE];
+static struct bio_shard cache[BIO_SHARD_COUNT] = {
+	[0 ... BIO_SHARD_COUNT - 1] = {
+		.lock  = MUTEX_INIT,
+		.limit = {
+			[BIO_CLASS_DATA] = BIO_CACHE_LIMIT >> BIO_CACHE_SHARDS,
+			[BIO_CLASS_META] = BIO_CACHE_META  >> BIO_CACHE_SHARDS,
+			[BIO_CLASS_PIN]  = BIO_CACHE_PIN   >> BIO_CACHE_SHARDS,
+		},
+	},
+};
 
-static size_t bio_cache_index (int dev, off_t offset)
+static uint32_t bio_cache_hash (int dev, off_t offset)
 {
 	uint32_t iv = 0;
 
@@ -25,35 +86,406 @@ static size_t bio_cache_index (int dev, off_t offset)
 	iv = oat_hash_step (iv, offset);
 	iv = oat_hash_step (iv, offset >> 32);
 
-	return oat_hash_final (iv) & BIO_CACHE_MASK;
+	return oat_hash_final (iv);
+}
+
+static struct bio_shard *bio_cache_shard (int dev, off_t offset)
+{
+	return cache + (bio_cache_hash (dev, offset) >> (32 - BIO_CACHE_SHARDS));
+}
+
+static size_t bio_cache_index (int dev, off_t offset, unsigned order)
+{
+	return bio_cache_hash (dev, offset) & ((1UL << order) - 1);
+}
+
+static struct bio **bio_cache_slot (struct bio_shard *s, int dev, off_t offset)
+{
+	struct bio **p = s->table + bio_cache_index (dev, offset, s->order);
+
+	for (; *p != NULL; p = &(*p)->bio_hnext)
+		if ((*p)->bio_dev == dev && (*p)->bio_offset == offset)
+			break;
+
+	return p;
+}
+
+/*
+ * Double the hash table when the average chain grows longer than one
+ * entry. On allocation failure we keep going with longer chains.
+ */
+static bool bio_cache_grow (struct bio_shard *s)
+{
+	const unsigned order = s->table == NULL ? BIO_CACHE_ORDER : s->order + 1;
+	struct bio **table, *o;
+	struct bio_ring *r;
+	size_t i, n;
+
+	if (s->table != NULL && s->count < (1UL << s->order))
+		return true;
+
+	if ((table = calloc (1UL << order, sizeof (table[0]))) == NULL)
+		return s->table != NULL;
+
+	for (r = s->ring; r < s->ring + BIO_RINGS; ++r)
+		for (o = r->hand, n = 0; n < r->count; o = o->bio_cnext, ++n) {
+			i = bio_cache_index (o->bio_dev, o->bio_offset, order);
+			o->bio_hnext = table[i];
+			table[i] = o;
+		}
+
+	free (s->table);
+	s->table = table;
+	s->order = order;
+	return true;
+}
+
+/*
+ * Ghost table is allocated lazily, without it all blocks go to probation
+ */
+static bool bio_ghost_take (struct bio_shard *s, const struct bio *o)
+{
+	const uint32_t key = bio_cache_hash (o->bio_dev, o->bio_offset) | 1;
+	uint32_t *slot;
+
+	if (s->ghost == NULL)
+		return false;
+
+	slot = s->ghost + ((key >> 1) & (BIO_GHOST_SIZE - 1));
+
+	if (*slot != key)
+		return false;
+
+	*slot = 0;
+	return true;
+}
+
+static void bio_ghost_put (struct bio_shard *s, const struct bio *o)
+{
+	const uint32_t key = bio_cache_hash (o->bio_dev, o->bio_offset) | 1;
+
+	if (s->ghost == NULL &&
+	    (s->ghost = calloc (BIO_GHOST_SIZE, sizeof (s->ghost[0]))) == NULL)
+		return;
+
+	s->ghost[(key >> 1) & (BIO_GHOST_SIZE - 1)] = key;
+}
+
+static struct bio_ring *bio_cache_ring (struct bio_shard *s, int class, int q)
+{
+	return s->ring + class * 2 + q;
+}
+
+/*
+ * Pinned blocks over the budget fall back to metadata class
+ */
+static int bio_cache_class (struct bio_shard *s, const struct bio *o, int class)
+{
+	const struct bio_ring *r = bio_cache_ring (s, BIO_CLASS_PIN, BIO_MAIN);
+
+	return	class == BIO_CLASS_PIN &&
+		r->size + o->bio_count > s->limit[BIO_CLASS_PIN] ?
+		BIO_CLASS_META : class;
 }
 
-struct bio *bio_cache_pull (int dev, off_t offset, size_t count)
+static void
+bio_ring_link (struct bio_shard *s, struct bio *o, int class, int queue)
 {
-	const size_t i = bio_cache_index (dev, offset);
-	struct bio *o, *ret = NULL;
+	struct bio_ring *r = bio_cache_ring (s, class, queue);
 
-	mutex_lock (&cache_lock);
-	o = cache[i];
+	o->bio_class = class;
+	o->bio_queue = queue;
 
-	if (o->bio_dev == dev && o->bio_offset == offset &&
-	    o->bio_count >= count)
+	if (r->hand == NULL) {
+		o->bio_cnext = o->bio_cprev = o;
+		r->hand = o;
+	}
+	else {	/* insert just behind the hand: the last one to be visited */
+		o->bio_cnext = r->hand;
+		o->bio_cprev = r->hand->bio_cprev;
+		o->bio_cprev->bio_cnext = o;
+		r->hand->bio_cprev = o;
+	}
+
+	++r->count;
+	r->size += o->bio_count;
+}
+
+static void bio_ring_unlink (struct bio_shard *s, struct bio *o)
+{
+	struct bio_ring *r = bio_cache_ring (s, o->bio_class, o->bio_queue);
+
+	if (o->bio_cnext == o)
+		r->hand = NULL;
+	else {
+		o->bio_cprev->bio_cnext = o->bio_cnext;
+		o->bio_cnext->bio_cprev = o->bio_cprev;
+
+		if (r->hand == o)
+			r->hand = o->bio_cnext;
+	}
+
+	--r->count;
+	r->size -= o->bio_count;
+}
+
+static void bio_cache_link (struct bio_shard *s, struct bio *o)
+{
+	struct bio **slot = bio_cache_slot (s, o->bio_dev, o->bio_offset);
+	const int class = bio_cache_class (s, o, o->bio_class);
+	const bool main = class == BIO_CLASS_PIN || bio_ghost_take (s, o);
+
+	o->bio_hnext = *slot;
+	*slot = o;
+	o->bio_used  = 0;
+	o->bio_stamp = s->tick++;
+
+	bio_ring_link (s, o, class, main ? BIO_MAIN : BIO_PROBE);
+	++s->count;
+}
+
+static void bio_cache_unlink (struct bio_shard *s, struct bio *o)
+{
+	*bio_cache_slot (s, o->bio_dev, o->bio_offset) = o->bio_hnext;
+
+	bio_ring_unlink (s, o);
+	--s->count;
+}
+
+/*
+ * Find the next victim of the queue: the hand visits blocks in FIFO order
+ * for probation, and clears reference bits on the way for main queue.
+ * Blocks in use, modified or with requests in flight (including ones
+ * waiting for delayed write-back) must stay visible, otherwise next lookup
+ * would read stale data from device.
+ */
+static bool bio_ring_idle (struct bio *o)
+{
+	if (atomic_load_explicit (&o->bio_ref, memory_order_relaxed) > 1)
+		return false;
+
+	if ((o->bio_state & BIO_BUSY) != 0 &&
+	    lockword_trywrlock (&o->bio_lock)) {
+		if ((o->bio_state & BIO_BUSY) != 0 && !aio_pending (o->bio_req))
+			bio_join (o);  /* completed already, never waits */
+
+		lockword_unlock (&o->bio_lock);
+	}
+
+	return (o->bio_state & (BIO_BUSY | BIO_DIRTY)) == 0;
+}
+
+static struct bio *bio_ring_victim (struct bio_ring *r, bool clock)
+{
+	struct bio *o;
+	size_t skip = 0;
+
+	for (; (o = r->hand) != NULL; r->hand = o->bio_cnext) {
+		if (clock && o->bio_used) {
+			o->bio_used = 0;
+			continue;
+		}
+
+		if (bio_ring_idle (o))
+			return o;
+
+		if (++skip > r->count)
+			break;
+	}
+
+	return NULL;
+}
+
+static void bio_cache_touch (struct bio_shard *s, struct bio *o)
+{
+	const struct bio_ring *r;
+
+	if (o->bio_queue == BIO_MAIN) {
+		o->bio_used = 1;
+		return;
+	}
+
+	r = bio_cache_ring (s, o->bio_class, BIO_PROBE);
+
+	if (s->tick - o->bio_stamp > r->count / 2)
+		o->bio_used = 1;
+}
+
+/*
+ * Evict blocks until the class fits into its budget, returns the list of
+ * evicted blocks chained by bio_hnext
+ */
+static struct bio *
+bio_cache_evict (struct bio_shard *s, int class, struct bio *list)
+{
+	struct bio_ring *in = bio_cache_ring (s, class, BIO_PROBE);
+	struct bio_ring *am = bio_cache_ring (s, class, BIO_MAIN);
+	const size_t limit = s->limit[class];
+	struct bio *o = NULL;
+
+	if (class == BIO_CLASS_PIN)
+		return list;
+
+	while (in->size + am->size > limit) {
+		if (in->size > limit / 4 || am->count == 0)
+			o = bio_ring_victim (in, false);
+
+		if (o == NULL && (o = bio_ring_victim (am, true)) == NULL &&
+		    (o = bio_ring_victim (in, false)) == NULL)
+			break;
+
+		if (o->bio_queue == BIO_PROBE && o->bio_used) {
+			bio_ring_unlink (s, o);
+			bio_ring_link (s, o, class, BIO_MAIN);
+			o->bio_used = 0;
+			o = NULL;
+			continue;
+		}
+
+		if (o->bio_queue == BIO_PROBE)
+			bio_ghost_put (s, o);
+
+		bio_stat_add (o->bio_dev, BIO_STAT_EVICT, 1);
+
+		bio_cache_unlink (s, o);
+		o->bio_hnext = list;
+		list = o;
+		o = NULL;
+	}
+
+	return list;
+}
+
+static void bio_cache_drop (struct bio *list)
+{
+	struct bio *next;
+
+	for (; list != NULL; list = next) {
+		next = list->bio_hnext;
+		bio_put (list);
+	}
+}
+
+struct bio *bio_cache_pull (int dev, off_t offset, size_t count, int class)
+{
+	struct bio_shard *s = bio_cache_shard (dev, offset);
+	struct bio *o, *ret = NULL, *list = NULL;
+
+	mutex_lock (&s->lock);
+
+	if (s->table != NULL &&
+	    (o = *bio_cache_slot (s, dev, offset)) != NULL &&
+	    o->bio_count >= count) {
+		bio_cache_touch (s, o);
 		ret = bio_ref (o);
 
-	mutex_unlock (&cache_lock);
+		if (class > o->bio_class &&
+		    (class = bio_cache_class (s, o, class)) > o->bio_class) {
+			bio_ring_unlink (s, o);
+			bio_ring_link (s, o, class, BIO_MAIN);
+			list = bio_cache_evict (s, class, list);
+		}
+	}
+
+	mutex_unlock (&s->lock);
+
+	bio_stat_add (dev, ret != NULL ? BIO_STAT_HIT : BIO_STAT_MISS, 1);
+	bio_cache_drop (list);
 	return ret;
 }
 
-void bio_cache_push (struct bio *o)
+struct bio *bio_cache_push (struct bio *o)
 {
-	const size_t i = bio_cache_index (o->bio_dev, o->bio_offset);
-	struct bio *old;
+	struct bio_shard *s = bio_cache_shard (o->bio_dev, o->bio_offset);
+	struct bio *old = NULL, *ret = o, *list = NULL;
 
-	mutex_lock (&cache_lock);
-	old = cache[i];
-	cache[i] = o;
-	mutex_unlock (&cache_lock);
+	mutex_lock (&s->lock);
+
+	if (!bio_cache_grow (s)) {
+		old = o;  /* no memory for table: do not cache at all */
+		goto out;
+	}
+
+	if ((old = *bio_cache_slot (s, o->bio_dev, o->bio_offset)) != NULL) {
+		if (old->bio_count >= o->bio_count) {
+			bio_cache_touch (s, old);
+			ret = bio_ref (old);
+			old = NULL;
+			goto out;
+		}
+
+		bio_cache_unlink (s, old);  /* too short, replace it */
+	}
+
+	bio_cache_link (s, o);
+	list = bio_cache_evict (s, o->bio_class, list);
+out:
+	mutex_unlock (&s->lock);
 
 	if (old != NULL)
 		bio_put (old);
+
+	bio_cache_drop (list);
+	return ret;
+}
+
+struct bio *bio_cache_peek (int dev, off_t offset)
+{
+	struct bio_shard *s = bio_cache_shard (dev, offset);
+	struct bio *o = NULL;
+
+	mutex_lock (&s->lock);
+
+	if (s->table != NULL &&
+	    (o = *bio_cache_slot (s, dev, offset)) != NULL)
+		bio_ref (o);
+
+	mutex_unlock (&s->lock);
+	return o;
+}
+
+void bio_cache_limit (int class, size_t limit)
+{
+	struct bio_shard *s;
+	struct bio *list;
+
+	for (s = cache; s < cache + BIO_SHARD_COUNT; ++s) {
+		mutex_lock (&s->lock);
+		s->limit[class] = limit >> BIO_CACHE_SHARDS;
+		list = bio_cache_evict (s, class, NULL);
+		mutex_unlock (&s->lock);
+
+		bio_cache_drop (list);
+	}
+}
+
+void bio_cache_purge (int dev)
+{
+	struct bio_shard *s;
+	struct bio_ring *r;
+	struct bio *o, *next, *list;
+	size_t n, count;
+
+	for (s = cache; s < cache + BIO_SHARD_COUNT; ++s) {
+		mutex_lock (&s->lock);
+
+		for (r = s->ring, list = NULL; r < s->ring + BIO_RINGS; ++r)
+			for (
+				o = r->hand, n = 0, count = r->count;
+				n < count;
+				o = next, ++n
+			) {
+				next = o->bio_cnext;
+
+				if (o->bio_dev == dev) {
+					bio_cache_unlink (s, o);
+					o->bio_hnext = list;
+					list = o;
+				}
+			}
+
+		mutex_unlock (&s->lock);
+
+		bio_cache_drop (list);
+	}
 }
@@ -0,0 +1,166 @@
+/*
+ * Block Device I/O Cache Class Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+
+#include <marten/bio-cache.h>
+#include <marten/device/block.h>
+
+#define BLOCK_SIZE	4096
+#define BLOCK_COUNT	16384
+
+#define PIN_COUNT	64	/* blocks read pinned			*/
+#define PIN_LIMIT	16	/* pinned budget, blocks		*/
+#define META_LIMIT	256	/* metadata budget, blocks		*/
+#define DATA_LIMIT	1024	/* data budget, blocks			*/
+
+static int dev;
+
+static int get (unsigned i, int mode)
+{
+	struct bio *o;
+
+	o = bio_read_class (dev, (off_t) i * BLOCK_SIZE, BLOCK_SIZE, mode);
+	if (o == NULL)
+		return 0;
+
+	bio_read_end (o);
+	bio_put (o);
+	return 1;
+}
+
+/*
+ * Return class of cached block without promotion, or -1 if not cached
+ */
+static int cached_class (unsigned i)
+{
+	struct bio *o;
+	int class;
+
+	if ((o = bio_cache_pull (dev, (off_t) i * BLOCK_SIZE, BLOCK_SIZE,
+				 BIO_CLASS_DATA)) == NULL)
+		return -1;
+
+	class = o->bio_class;
+	bio_put (o);
+	return class;
+}
+
+/*
+ * Pinned blocks over the budget fall back to metadata, and both survive
+ * streaming of data
+ */
+static int check_budget (void)
+{
+	unsigned i, pin, meta;
+	int class;
+
+	for (i = 0; i < PIN_COUNT; ++i)
+		if (!get (i, BIO_PIN))
+			return 0;
+
+	for (i = PIN_COUNT; i < BLOCK_COUNT; ++i)
+		if (!get (i, 0))
+			return 0;
+
+	for (i = 0, pin = 0, meta = 0; i < PIN_COUNT; ++i)
+		if ((class = cached_class (i)) == BIO_CLASS_PIN)
+			++pin;
+		else if (class == BIO_CLASS_META)
+			++meta;
+		else {
+			fprintf (stderr, "E: block %u lost its class\n", i);
+			return 0;
+		}
+
+	if (pin == 0 || pin > PIN_LIMIT || meta == 0) {
+		fprintf (stderr, "E: %u blocks pinned, %u overflowed\n",
+			 pin, meta);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * A hit with higher class promotes data block
+ */
+static int check_promote (void)
+{
+	const unsigned i = BLOCK_COUNT - 1;
+
+	if (!get (i, 0) || cached_class (i) != BIO_CLASS_DATA ||
+	    !get (i, BIO_META) || cached_class (i) != BIO_CLASS_META) {
+		fprintf (stderr, "E: block is not promoted on hit\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * A one-off scan must not flush working set out of data cache
+ */
+static int check_scan (void)
+{
+	const unsigned base = PIN_COUNT, work = DATA_LIMIT / 4;
+	unsigned i, j, hits, total;
+	struct bio *o;
+
+	for (j = 0; j < work; ++j)
+		if (!get (base + j, 0))
+			return 0;
+
+	for (i = base + work, hits = 0, total = 0; i < BLOCK_COUNT - 1; ++i) {
+		if (!get (i, 0))
+			return 0;
+
+		if (i % 2 != 0)
+			continue;
+
+		j = base + (i / 2) % work;
+
+		o = bio_cache_pull (dev, (off_t) j * BLOCK_SIZE, BLOCK_SIZE,
+				    BIO_CLASS_DATA);
+		if (o != NULL) {
+			++hits;
+			bio_put (o);
+		}
+		else if (!get (j, 0))
+			return 0;
+
+		++total;
+	}
+
+	if (hits * 10 < total * 9) {
+		fprintf (stderr, "E: working set hit rate %u of %u\n",
+			 hits, total);
+		return 0;
+	}
+
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	int ok;
+
+	if ((dev = dev_block_ram ((size_t) BLOCK_COUNT * BLOCK_SIZE)) == -1) {
+		perror ("E: ram disk");
+		return 1;
+	}
+
+	bio_cache_limit (BIO_CLASS_PIN,  PIN_LIMIT  * BLOCK_SIZE);
+	bio_cache_limit (BIO_CLASS_META, META_LIMIT * BLOCK_SIZE);
+	bio_cache_limit (BIO_CLASS_DATA, DATA_LIMIT * BLOCK_SIZE);
+
+	ok = check_budget () && check_promote () && check_scan ();
+
+	dev_block_close (dev);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,88 @@
+/*
+ * Block Device I/O Statistics Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <marten/bio.h>
+#include <marten/bio-stat.h>
+#include <marten/device/block.h>
+
+#define BLOCK_SIZE	4096
+#define ROUNDS		200	/* distinct devices, more than tracked	*/
+
+static const char *path = "bio-stat-test.tmp";
+
+static int read_one (int dev)
+{
+	struct bio *o;
+
+	if ((o = bio_read (dev, 0, BLOCK_SIZE)) == NULL)
+		return 0;
+
+	bio_read_end (o);
+	bio_put (o);
+	return 1;
+}
+
+/*
+ * Every round opens the image with a new descriptor number, the slot of
+ * statistics must be released on close and taken by next devices
+ */
+static int check_slots (void)
+{
+	int hold[ROUNDS], i, n, dev, ok = 1;
+	struct bio_stat s;
+
+	for (n = 0; n < ROUNDS && ok; ++n) {
+		if ((dev = dev_block_open (path, 0)) == -1)
+			break;
+
+		ok = bio_stat_snapshot (dev, &s) == 0 && read_one (dev) &&
+		     bio_stat_snapshot (dev, &s) &&
+		     s.count[BIO_STAT_READ] == 1 &&
+		     s.count[BIO_STAT_READ_BYTES] == BLOCK_SIZE;
+
+		dev_block_close (dev);
+		ok = ok && !bio_stat_snapshot (dev, &s);
+
+		if (!ok)
+			fprintf (stderr, "E: device %d statistics wrong\n", dev);
+
+		if ((hold[n] = dup (0)) == -1)  /* next open takes next number */
+			break;
+	}
+
+	for (i = 0; i < n; ++i)
+		close (hold[i]);
+
+	return ok && n == ROUNDS;
+}
+
+int main (int argc, char *argv[])
+{
+	char buf[BLOCK_SIZE];
+	int fd, ok;
+
+	if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1) {
+		perror ("E: open");
+		return 1;
+	}
+
+	memset (buf, 'x', sizeof (buf));
+	ok = write (fd, buf, sizeof (buf)) == sizeof (buf);
+	close (fd);
+
+	ok = ok && check_slots ();
+
+	unlink (path);
+	return ok ? 0 : 1;
+}
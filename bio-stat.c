@@ -0,0 +1,244 @@
+/*
+ * Block Device I/O Statistics
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <marten/atomic.h>
+#include <marten/bio-stat.h>
+#include <marten/mutex.h>
+
+#define BIO_STAT_DEVS		64	/* max devices tracked		*/
+#define BIO_STAT_SHARDS		16	/* counter shards per device	*/
+#define BIO_STAT_LINE		64	/* cache line size, bytes	*/
+#define BIO_STAT_FREE		INT_MIN		/* never used slot	*/
+#define BIO_STAT_DEAD		(INT_MIN + 1)	/* released slot	*/
+
+/*
+ * Every tracked device owns a slot of the open-addressed table, slots are
+ * claimed and released under lock, thus lookups need no locks. Released
+ * slots are skipped by lookups and reused by next claims, shard memory
+ * is never freed, thus a late update from request of closed device never
+ * touches freed memory. The counters of a device are split into cache
+ * line aligned shards, every thread updates its own shard.
+ */
+struct bio_stat_shard {
+	atomic_ullong	count[BIO_STAT_COUNT];
+	atomic_ullong	wait[2][BIO_STAT_ORDERS];	/* read, write	*/
+} __attribute__ ((aligned (BIO_STAT_LINE)));
+
+struct bio_stat_dev {
+	atomic_int		dev;
+	struct bio_stat_shard	*shard;
+};
+
+static mutex_t stat_lock = MUTEX_INIT;
+static struct bio_stat_dev stat_table[BIO_STAT_DEVS] = {
+	[0 ... BIO_STAT_DEVS - 1] = { .dev = BIO_STAT_FREE },
+};
+
+static atomic_uint stat_next;
+static __thread unsigned stat_index = UINT_MAX;
+
+static struct bio_stat_dev *bio_stat_claim (int dev, size_t start)
+{
+	struct bio_stat_dev *o, *slot = NULL;
+	size_t i = start, size;
+	int owner;
+
+	do {
+		o = stat_table + i;
+
+		if ((owner = o->dev) == dev)
+			return o;
+
+		if (owner == BIO_STAT_FREE || owner == BIO_STAT_DEAD) {
+			if (slot == NULL)
+				slot = o;
+
+			if (owner == BIO_STAT_FREE)
+				break;
+		}
+
+		i = (i + 1) % BIO_STAT_DEVS;
+	}
+	while (i != start);
+
+	if ((o = slot) == NULL)
+		return NULL;
+
+	size = sizeof (o->shard[0]) * BIO_STAT_SHARDS;
+
+	if (o->shard == NULL &&
+	    (o->shard = aligned_alloc (BIO_STAT_LINE, size)) == NULL)
+		return NULL;
+
+	memset (o->shard, 0, size);
+	atomic_store_explicit (&o->dev, dev, memory_order_release);
+	return o;
+}
+
+static struct bio_stat_shard *bio_stat_find (int dev, bool create)
+{
+	const size_t start = (unsigned) dev % BIO_STAT_DEVS;
+	struct bio_stat_dev *o;
+	size_t i = start;
+	int owner;
+	bool dead = false;
+
+	do {
+		o = stat_table + i;
+		owner = atomic_load_explicit (&o->dev, memory_order_acquire);
+
+		if (owner == dev)
+			return o->shard;
+
+		if (owner == BIO_STAT_FREE)
+			break;
+
+		dead |= owner == BIO_STAT_DEAD;
+		i = (i + 1) % BIO_STAT_DEVS;
+	}
+	while (i != start);
+
+	if (!create || (owner != BIO_STAT_FREE && !dead))
+		return NULL;
+
+	mutex_lock (&stat_lock);
+	o = bio_stat_claim (dev, start);
+	mutex_unlock (&stat_lock);
+
+	return o == NULL ? NULL : o->shard;
+}
+
+static struct bio_stat_shard *bio_stat_shard (int dev)
+{
+	struct bio_stat_shard *s;
+
+	if ((s = bio_stat_find (dev, true)) == NULL)
+		return NULL;
+
+	if (stat_index == UINT_MAX)
+		stat_index = atomic_fetch_add_explicit (&stat_next, 1,
+							memory_order_relaxed) %
+			     BIO_STAT_SHARDS;
+
+	return s + stat_index;
+}
+
+void bio_stat_add (int dev, int counter, uint64_t value)
+{
+	struct bio_stat_shard *s;
+
+	if ((s = bio_stat_shard (dev)) != NULL)
+		atomic_fetch_add_explicit (s->count + counter, value,
+					   memory_order_relaxed);
+}
+
+void bio_stat_io (int dev, bool write, uint64_t bytes)
+{
+	const int count = write ? BIO_STAT_WRITE : BIO_STAT_READ;
+	const int size  = write ? BIO_STAT_WRITE_BYTES : BIO_STAT_READ_BYTES;
+	struct bio_stat_shard *s;
+
+	if ((s = bio_stat_shard (dev)) == NULL)
+		return;
+
+	atomic_fetch_add_explicit (s->count + count, 1, memory_order_relaxed);
+	atomic_fetch_add_explicit (s->count + size, bytes, memory_order_relaxed);
+}
+
+void bio_stat_wait (int dev, bool write, uint64_t ns)
+{
+	const int counter = write ? BIO_STAT_WRITE_WAIT : BIO_STAT_READ_WAIT;
+	int order = ns == 0 ? 0 : 63 - __builtin_clzll (ns);
+	struct bio_stat_shard *s;
+
+	if ((s = bio_stat_shard (dev)) == NULL)
+		return;
+
+	if (order >= BIO_STAT_ORDERS)
+		order = BIO_STAT_ORDERS - 1;
+
+	atomic_fetch_add_explicit (s->count + counter, ns,
+				   memory_order_relaxed);
+	atomic_fetch_add_explicit (s->wait[write] + order, 1,
+				   memory_order_relaxed);
+}
+
+bool bio_stat_snapshot (int dev, struct bio_stat *o)
+{
+	const struct bio_stat_shard *s = bio_stat_find (dev, false), *p;
+	size_t i;
+
+	memset (o, 0, sizeof (*o));
+
+	if (s == NULL)
+		return false;
+
+	for (p = s; p < s + BIO_STAT_SHARDS; ++p) {
+		for (i = 0; i < BIO_STAT_COUNT; ++i)
+			o->count[i] += atomic_load_explicit (p->count + i,
+							     memory_order_relaxed);
+
+		for (i = 0; i < BIO_STAT_ORDERS; ++i) {
+			o->read_wait[i]  += atomic_load_explicit (p->wait[0] + i,
+								  memory_order_relaxed);
+			o->write_wait[i] += atomic_load_explicit (p->wait[1] + i,
+								  memory_order_relaxed);
+		}
+	}
+
+	return true;
+}
+
+void bio_stat_reset (int dev)
+{
+	struct bio_stat_shard *s = bio_stat_find (dev, false), *p;
+	size_t i;
+
+	if (s == NULL)
+		return;
+
+	for (p = s; p < s + BIO_STAT_SHARDS; ++p) {
+		for (i = 0; i < BIO_STAT_COUNT; ++i)
+			atomic_store_explicit (p->count + i, 0,
+					       memory_order_relaxed);
+
+		for (i = 0; i < BIO_STAT_ORDERS; ++i) {
+			atomic_store_explicit (p->wait[0] + i, 0,
+					       memory_order_relaxed);
+			atomic_store_explicit (p->wait[1] + i, 0,
+					       memory_order_relaxed);
+		}
+	}
+}
+
+void bio_stat_release (int dev)
+{
+	const size_t start = (unsigned) dev % BIO_STAT_DEVS;
+	size_t i = start;
+	int owner;
+
+	mutex_lock (&stat_lock);
+
+	do {
+		if ((owner = stat_table[i].dev) == dev)
+			atomic_store_explicit (&stat_table[i].dev, BIO_STAT_DEAD,
+					       memory_order_release);
+
+		if (owner == dev || owner == BIO_STAT_FREE)
+			break;
+
+		i = (i + 1) % BIO_STAT_DEVS;
+	}
+	while (i != start);
+
+	mutex_unlock (&stat_lock);
+}
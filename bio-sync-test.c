@@ -0,0 +1,314 @@
+/*
+ * Block Device Delayed Write-back Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <marten/bio.h>
+#include <marten/bio-cache.h>
+#include <marten/bio-stat.h>
+#include <marten/device/block.h>
+
+#define BLOCK_SIZE	4096
+#define BLOCK_COUNT	16
+
+static const unsigned dirty[] = { 0, 2, 3, 4, 7 };  /* three runs */
+
+static int is_dirty (unsigned i)
+{
+	size_t k;
+
+	for (k = 0; k < sizeof (dirty) / sizeof (dirty[0]); ++k)
+		if (dirty[k] == i)
+			return 1;
+
+	return 0;
+}
+
+static int dirty_all (int dev)
+{
+	struct bio *o;
+	size_t k;
+	unsigned i;
+
+	for (k = 0; k < sizeof (dirty) / sizeof (dirty[0]); ++k) {
+		i = dirty[k];
+
+		if ((o = bio_write (dev, i * BLOCK_SIZE, BLOCK_SIZE, 0)) == NULL)
+			return 0;
+
+		memset (o->bio_data, 'a' + i, BLOCK_SIZE);
+
+		if (!bio_write_defer (o))
+			return 0;
+
+		bio_put (o);
+	}
+
+	return 1;
+}
+
+/*
+ * Compare device contents with expected: dirty blocks filled with their
+ * own letter after sync, zeroes everywhere else
+ */
+static int check_dev (int dev, int synced)
+{
+	char buf[BLOCK_SIZE], want[BLOCK_SIZE];
+	unsigned i;
+
+	for (i = 0; i < BLOCK_COUNT; ++i) {
+		if (dev_block_read (dev, buf, BLOCK_SIZE,
+				    i * BLOCK_SIZE) != BLOCK_SIZE)
+			return 0;
+
+		memset (want, synced && is_dirty (i) ? 'a' + i : 0, BLOCK_SIZE);
+
+		if (memcmp (buf, want, BLOCK_SIZE) != 0) {
+			fprintf (stderr, "E: block %u %s sync\n", i,
+				 synced ? "lost after" : "written before");
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+static int check_cache (int dev)
+{
+	struct bio *o;
+	unsigned i;
+	const char *p;
+	int ok = 1;
+
+	for (i = 0; i < BLOCK_COUNT && ok; ++i) {
+		if ((o = bio_read (dev, i * BLOCK_SIZE, BLOCK_SIZE)) == NULL)
+			return 0;
+
+		p = o->bio_data;
+		ok = p[0] == (is_dirty (i) ? 'a' + i : 0) &&
+		     memcmp (p, p + 1, BLOCK_SIZE - 1) == 0;
+
+		bio_read_end (o);
+		bio_put (o);
+	}
+
+	if (!ok)
+		fprintf (stderr, "E: block %u read back corrupted\n", i - 1);
+
+	return ok;
+}
+
+/*
+ * Dirty blocks, sync them, then drop them from cache and read back with
+ * batched prefetch
+ */
+static int run (int dev)
+{
+	struct bio_stat s;
+	int ok;
+
+	ok = dirty_all (dev) && check_dev (dev, 0) && bio_sync_dev (dev) &&
+	     check_dev (dev, 1) && check_cache (dev) &&
+	     bio_stat_snapshot (dev, &s);
+
+	if (ok && s.count[BIO_STAT_WRITE] != 3) {
+		fprintf (stderr, "E: %llu writes, adjacent blocks not merged\n",
+			 (unsigned long long) s.count[BIO_STAT_WRITE]);
+		ok = 0;
+	}
+
+	/* nothing left to write */
+	ok = ok && bio_sync_dev (dev) && bio_stat_snapshot (dev, &s) &&
+	     s.count[BIO_STAT_WRITE] == 3;
+
+	if (ok) {
+		bio_cache_purge (dev);
+		bio_prefetch (dev, 0, BLOCK_COUNT * BLOCK_SIZE, BLOCK_SIZE, 0);
+		ok = check_cache (dev);
+	}
+
+	dev_block_close (dev);
+	return ok;
+}
+
+/*
+ * Memory device that fails writes on demand
+ */
+struct flaky {
+	char	data[BLOCK_COUNT * BLOCK_SIZE];
+	int	fail, closed;
+};
+
+static ssize_t
+flaky_read (void *cookie, void *buf, size_t count, off_t pos)
+{
+	struct flaky *o = cookie;
+
+	memcpy (buf, o->data + pos, count);
+	return count;
+}
+
+static ssize_t
+flaky_write (void *cookie, const void *buf, size_t count, off_t pos)
+{
+	struct flaky *o = cookie;
+
+	if (o->fail) {
+		errno = EIO;
+		return -1;
+	}
+
+	memcpy (o->data + pos, buf, count);
+	return count;
+}
+
+static ssize_t
+flaky_readv (void *cookie, const struct iovec *iov, int n, off_t pos)
+{
+	ssize_t total = 0;
+	int i;
+
+	for (i = 0; i < n; pos += iov[i].iov_len, total += iov[i].iov_len, ++i)
+		flaky_read (cookie, iov[i].iov_base, iov[i].iov_len, pos);
+
+	return total;
+}
+
+static ssize_t
+flaky_writev (void *cookie, const struct iovec *iov, int n, off_t pos)
+{
+	ssize_t total = 0;
+	int i;
+
+	for (i = 0; i < n; pos += iov[i].iov_len, total += iov[i].iov_len, ++i)
+		if (flaky_write (cookie, iov[i].iov_base, iov[i].iov_len,
+				 pos) < 0)
+			return -1;
+
+	return total;
+}
+
+static int flaky_flush (void *cookie)
+{
+	return 0;
+}
+
+static void flaky_prefetch (void *cookie, off_t pos, size_t count)
+{
+}
+
+static void flaky_close (void *cookie)
+{
+	struct flaky *o = cookie;
+
+	o->closed = 1;
+}
+
+static const struct dev_ops flaky_ops = {
+	.read     = flaky_read,
+	.write    = flaky_write,
+	.readv    = flaky_readv,
+	.writev   = flaky_writev,
+	.flush    = flaky_flush,
+	.prefetch = flaky_prefetch,
+	.close    = flaky_close,
+};
+
+static int flaky_data (const struct flaky *o, int synced)
+{
+	unsigned i;
+
+	for (i = 0; i < BLOCK_COUNT; ++i)
+		if (o->data[i * BLOCK_SIZE] != (synced && is_dirty (i) ?
+						'a' + i : 0))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Failed sync keeps blocks queued for the next one, and the blocks still
+ * queued on close are dropped without writing to the closed device
+ */
+static int check_retry (void)
+{
+	static struct flaky f;
+	int dev, ok;
+
+	if ((dev = dev_block_attach (&flaky_ops, &f, sizeof (f.data))) == -1)
+		return 0;
+
+	f.fail = 1;
+	ok = dirty_all (dev) && !bio_sync_dev (dev) && flaky_data (&f, 0);
+
+	f.fail = 0;
+	ok = ok && bio_sync_dev (dev) && flaky_data (&f, 1);
+
+	memset (f.data, 0, sizeof (f.data));
+	f.fail = 1;
+	ok = ok && dirty_all (dev) && !bio_sync_dev (dev);
+
+	dev_block_close (dev);
+	ok = ok && f.closed && flaky_data (&f, 0);
+
+	if (!ok)
+		fprintf (stderr, "E: failed delayed writes mishandled\n");
+
+	return ok;
+}
+
+static int open_file (const char *path)
+{
+	int fd, dev;
+
+	if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+		return -1;
+
+	if (ftruncate (fd, BLOCK_COUNT * BLOCK_SIZE) != 0) {
+		close (fd);
+		return -1;
+	}
+
+	close (fd);
+	dev = dev_block_open (path, DEV_WRITE);
+	unlink (path);
+	return dev;
+}
+
+int main (int argc, char *argv[])
+{
+	int dev, ok;
+
+	if ((dev = dev_block_ram (BLOCK_COUNT * BLOCK_SIZE)) == -1) {
+		perror ("E: ram disk");
+		return 1;
+	}
+
+	if (!(ok = run (dev)))
+		fprintf (stderr, "E: delayed write-back to RAM disk failed\n");
+
+	ok &= check_retry ();
+
+	if ((dev = open_file ("bio-sync-test.tmp")) == -1) {
+		perror ("E: open");
+		return 1;
+	}
+
+	if (!run (dev)) {
+		fprintf (stderr, "E: delayed write-back to file failed\n");
+		ok = 0;
+	}
+
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,272 @@
+/*
+ * Block Device I/O Delayed Write-Back
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <limits.h>
+#include <stdlib.h>
+
+#include <sys/uio.h>
+
+#include <marten/bio.h>
+#include <marten/mutex.h>
+
+#if !defined (IOV_MAX) && defined (UIO_MAXIOV)
+#define IOV_MAX		UIO_MAXIOV
+#endif
+
+/*
+ * Every device with delayed writes has a list of dirty blocks chained by
+ * bio_dnext. The list holds a reference to every block on it, and blocks
+ * stay marked with bio_queued until written to protect them from cache
+ * eviction.
+ */
+struct bio_dirty {
+	struct bio_dirty *next;
+	int		dev;
+	size_t		count;
+	struct bio	*head;
+};
+
+static mutex_t dirty_lock = MUTEX_INIT;
+static struct bio_dirty *dirty;
+
+static struct bio_dirty *bio_dirty_find (int dev)
+{
+	struct bio_dirty *o;
+
+	for (o = dirty; o != NULL; o = o->next)
+		if (o->dev == dev)
+			return o;
+
+	return NULL;
+}
+
+static struct bio_dirty *bio_dirty_get (int dev)
+{
+	struct bio_dirty *o;
+
+	if ((o = bio_dirty_find (dev)) != NULL)
+		return o;
+
+	if ((o = malloc (sizeof (*o))) == NULL)
+		return NULL;
+
+	o->next  = dirty;
+	o->dev   = dev;
+	o->count = 0;
+	o->head  = NULL;
+
+	return dirty = o;
+}
+
+bool bio_write_defer (struct bio *o)
+{
+	struct bio_dirty *d;
+	bool ok = true;
+
+	o->bio_state |= (BIO_READY | BIO_DIRTY);
+
+	mutex_lock (&dirty_lock);
+
+	if (o->bio_queued)
+		goto out;
+
+	if ((d = bio_dirty_get (o->bio_dev)) == NULL) {
+		ok = bio_save_emit (o);  /* fall back to immediate write */
+		goto out;
+	}
+
+	o->bio_dnext  = d->head;
+	o->bio_queued = true;
+	d->head = bio_ref (o);
+	++d->count;
+out:
+	mutex_unlock (&dirty_lock);
+	lockword_unlock (&o->bio_lock);
+	return ok;
+}
+
+static int bio_cmp (const void *a, const void *b)
+{
+	const struct bio *x = *(struct bio *const *) a;
+	const struct bio *y = *(struct bio *const *) b;
+
+	return x->bio_offset < y->bio_offset ? -1 : x->bio_offset > y->bio_offset;
+}
+
+/*
+ * Write a run of adjacent blocks with one vectored request
+ */
+static bool bio_save_run (struct bio **v, size_t n, struct iovec *iov)
+{
+	size_t i, total = 0;
+
+	for (i = 0; i < n; ++i) {
+		iov[i].iov_base = (void *) v[i]->bio_data;
+		iov[i].iov_len  = v[i]->bio_count;
+		total += v[i]->bio_count;
+	}
+
+	if (dev_block_writev (v[0]->bio_dev, iov, n, v[0]->bio_offset) != total)
+		return false;
+
+	bio_stat_io (v[0]->bio_dev, true, total);
+
+	for (i = 0; i < n; ++i)
+		v[i]->bio_state &= ~BIO_DIRTY;
+
+	return true;
+}
+
+static size_t bio_run (struct bio **v, size_t n)
+{
+	size_t i;
+
+	if ((v[0]->bio_state & BIO_DIRTY) == 0)
+		return 1;
+
+	for (
+		i = 1;
+		i < n && i < IOV_MAX &&
+		(v[i]->bio_state & BIO_DIRTY) != 0 &&
+		v[i - 1]->bio_offset + v[i - 1]->bio_count == v[i]->bio_offset;
+		++i
+	);
+
+	return i;
+}
+
+/*
+ * Write listed blocks taken off the dirty list, blocks still dirty after
+ * that are put back onto the list with their references, and their slots
+ * in v are cleared
+ */
+static bool bio_save_list (struct bio **v, size_t n)
+{
+	struct iovec *iov;
+	struct bio_dirty *d;
+	struct bio *o;
+	size_t i, run;
+	bool ok;
+
+	iov = malloc (sizeof (iov[0]) * (n < IOV_MAX ? n : IOV_MAX));
+	ok  = iov != NULL;
+
+	/* requests are joined and state changed under exclusive lock */
+	for (i = 0; i < n; ++i) {
+		lockword_wrlock (&v[i]->bio_lock);
+
+		if ((v[i]->bio_state & BIO_BUSY) != 0)
+			ok &= bio_join (v[i]);
+	}
+
+	for (i = 0; iov != NULL && i < n; i += run)
+		if ((run = bio_run (v + i, n - i)) > 1 ||
+		    (v[i]->bio_state & BIO_DIRTY) != 0)
+			ok &= bio_save_run (v + i, run, iov);
+
+	/* blocks failed to be written stay queued for the next sync */
+	for (i = 0; i < n; ++i) {
+		o = v[i];
+		mutex_lock (&dirty_lock);
+
+		if ((o->bio_state & BIO_DIRTY) != 0 &&
+		    (d = bio_dirty_find (o->bio_dev)) != NULL) {
+			o->bio_dnext = d->head;
+			d->head = o;
+			++d->count;
+			v[i] = NULL;  /* reference is kept by the list */
+		}
+		else
+			o->bio_queued = false;
+
+		mutex_unlock (&dirty_lock);
+		lockword_unlock (&o->bio_lock);
+	}
+
+	free (iov);
+	return ok;
+}
+
+bool bio_write_back (int dev)
+{
+	struct bio_dirty *d;
+	struct bio *o, **v;
+	size_t count = 0, i;
+	bool ok;
+
+	mutex_lock (&dirty_lock);
+
+	if ((d = bio_dirty_find (dev)) == NULL || d->count == 0) {
+		mutex_unlock (&dirty_lock);
+		return true;
+	}
+
+	if ((v = malloc (sizeof (v[0]) * d->count)) == NULL) {
+		mutex_unlock (&dirty_lock);
+		return false;
+	}
+
+	for (o = d->head; o != NULL; o = o->bio_dnext)
+		v[count++] = o;
+
+	d->head  = NULL;
+	d->count = 0;
+	mutex_unlock (&dirty_lock);
+
+	qsort (v, count, sizeof (v[0]), bio_cmp);
+	ok = bio_save_list (v, count);
+
+	for (i = 0; i < count; ++i)
+		if (v[i] != NULL)
+			bio_put (v[i]);
+
+	free (v);
+	return ok;
+}
+
+bool bio_sync_dev (int dev)
+{
+	const bool ok = bio_write_back (dev);
+
+	return dev_block_flush (dev) == 0 && ok;
+}
+
+void bio_sync_release (int dev)
+{
+	struct bio_dirty **p, *d;
+	struct bio *o, *next;
+
+	mutex_lock (&dirty_lock);
+
+	for (p = &dirty; (d = *p) != NULL && d->dev != dev; p = &d->next) {}
+
+	if (d != NULL)
+		*p = d->next;
+
+	mutex_unlock (&dirty_lock);
+
+	if (d == NULL)
+		return;
+
+	/* writes failed to be written back are lost with the device */
+	for (o = d->head; o != NULL; o = next) {
+		next = o->bio_dnext;
+
+		lockword_wrlock (&o->bio_lock);
+		o->bio_state &= ~BIO_DIRTY;
+
+		mutex_lock (&dirty_lock);
+		o->bio_queued = false;
+		mutex_unlock (&dirty_lock);
+
+		lockword_unlock (&o->bio_lock);
+		bio_put (o);
+	}
+
+	free (d);
+}
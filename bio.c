@@ -6,53 +6,181 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include <marten/bio-cache.h>
+#include <marten/cond.h>
+#include <marten/device/block.h>
+#include <marten/mutex.h>
+#include <marten/pool.h>
+#include <marten/thread.h>
 
+static int bio_mode_class (int mode)
+{
+	return	(mode & BIO_PIN)  != 0 ? BIO_CLASS_PIN  :
+		(mode & BIO_META) != 0 ? BIO_CLASS_META : BIO_CLASS_DATA;
+}
+
+static void bio_destroy (struct bio *o)
+{
+	pool_free ((void *) o->bio_data, o->bio_count);
+	pool_free (o, sizeof (*o));
+}
+
+/*
+ * New block is inserted into the cache before the read is emitted under
+ * its exclusive lock, thus concurrent misses on the same block share one
+ * copy and one request
+ */
 static struct bio *bio_alloc (int dev, off_t offset, size_t count, int mode)
 {
-	struct bio *o;
+	struct bio *o, *c;
+	bool ok;
 
-	if ((o = malloc (sizeof (*o))) == NULL)
+	if ((o = pool_alloc (sizeof (*o))) == NULL)
 		return NULL;
 
-	if ((o->bio_data = malloc (count)) == NULL)
+	if ((o->bio_data = pool_alloc (count)) == NULL)
 		goto no_data;
 
-	rwlock_init (&o->bio_lock);
-	memset (&o->bio_cb, 0, sizeof (o->bio_cb));
+	lockword_init (&o->bio_lock);
 
+	o->bio_req    = NULL;
 	o->bio_ref    = 2;	/* one for retval, plus one for cache	*/
 	o->bio_state  = 0;
+	o->bio_queued = false;
+	o->bio_class  = bio_mode_class (mode);
 	o->bio_dev    = dev;
 	o->bio_count  = count;
 	o->bio_offset = offset;
 
-	if ((mode & BIO_R) != 0 && !bio_load_emit (o))
-		goto no_read;
+	lockword_wrlock (&o->bio_lock);
+
+	if ((c = bio_cache_push (o)) != o) {
+		lockword_unlock (&o->bio_lock);
+		bio_destroy (o);  /* lost the race, never shared */
+		return c;
+	}
 
-	bio_cache_push (o);
-	return o;
-no_read:
+	ok = (mode & BIO_R) == 0 || bio_load_emit (o);
+	lockword_unlock (&o->bio_lock);
+
+	if (ok)
+		return o;
+
+	bio_put (o);
+	return NULL;
 no_data:
-	free (o);
+	pool_free (o, sizeof (*o));
 	return NULL;
 }
 
+/*
+ * Finish requests in flight, write back modified data and free the block
+ */
+static void bio_release (struct bio *o)
+{
+	if ((o->bio_state & BIO_LOAD) != 0)
+		bio_join (o);
+
+	bio_save (o);
+	bio_destroy (o);
+}
+
+/*
+ * Released blocks with requests in flight are queued to the reaper thread
+ * which waits for completion and frees them, thus the last bio_put never
+ * blocks on I/O. The queue is chained by bio_hnext, as released blocks do
+ * not belong to the cache anymore.
+ */
+static mutex_t reap_lock = MUTEX_INIT;
+static cond_t  reap_cond = COND_INIT;
+static cond_t  reap_done = COND_INIT;
+static struct bio *reap_head, **reap_tail = &reap_head;
+static size_t reap_count;	/* blocks queued or being released	*/
+static int reap_state;		/* 0 - not started, 1 - run, -1 - fail	*/
+
+static void *bio_reaper (void *cookie)
+{
+	struct bio *o;
+
+	for (;;) {
+		mutex_lock (&reap_lock);
+
+		while ((o = reap_head) == NULL)
+			cond_wait (&reap_cond, &reap_lock);
+
+		if ((reap_head = o->bio_hnext) == NULL)
+			reap_tail = &reap_head;
+
+		mutex_unlock (&reap_lock);
+
+		bio_release (o);
+
+		mutex_lock (&reap_lock);
+
+		if (--reap_count == 0)
+			cond_broadcast (&reap_done);
+
+		mutex_unlock (&reap_lock);
+	}
+
+	return NULL;
+}
+
+static bool bio_reap (struct bio *o)
+{
+	thread_t t;
+
+	mutex_lock (&reap_lock);
+
+	if (reap_state == 0)
+		reap_state = thread_create (&t, bio_reaper, NULL) &&
+			     thread_detach (t) ? 1 : -1;
+
+	if (reap_state < 0) {
+		mutex_unlock (&reap_lock);
+		return false;
+	}
+
+	o->bio_hnext = NULL;
+	*reap_tail = o;
+	reap_tail = &o->bio_hnext;
+	++reap_count;
+
+	cond_signal (&reap_cond);
+	mutex_unlock (&reap_lock);
+	return true;
+}
+
 static void bio_free (struct bio *o)
 {
-	bio_save (o);  /* to do: bio_save_async and free in io-complete */
-	free ((void *) o->bio_data);
-	free (o);
+	if ((o->bio_state & (BIO_DIRTY | BIO_BUSY)) == 0) {
+		bio_destroy (o);
+		return;
+	}
+
+	if (!bio_save_async (o) || !bio_reap (o))
+		bio_release (o);
 }
 
+/*
+ * Requests are extended to the cache unit and direct I/O alignment of
+ * device, thus every sub-unit request hits the block of its unit
+ */
 struct bio *bio_get (int dev, off_t offset, size_t count, int mode)
 {
-	struct bio *o = bio_cache_pull (dev, offset, count);
+	struct bio *o;
+
+	dev_block_round (dev, &offset, &count);
+
+	if ((o = bio_cache_pull (dev, offset, count,
+				 bio_mode_class (mode))) != NULL)
+		return o;
 
-	return o != NULL ? o : bio_alloc (dev, offset, count, mode);
+	return bio_alloc (dev, offset, count, mode);
 }
 
 void bio_put (struct bio *o)
@@ -65,49 +193,224 @@ void bio_put (struct bio *o)
 	bio_free (o);
 }
 
-bool bio_load (struct bio *o)
+bool bio_load_tail (struct bio *o, ssize_t len)
 {
-	if ((o->bio_state & BIO_READY) != 0)
+	if (len == o->bio_count)
 		return true;
 
-	if (!bio_load_emit (o) || !bio_join (o))
+	if (len <= 0 || o->bio_offset + len < dev_block_size (o->bio_dev)) {
+		if (len >= 0)
+			errno = EIO;
+
+		return false;
+	}
+
+	memset ((void *) o->bio_data + len, 0, o->bio_count - len);
+	return true;
+}
+
+bool bio_load_sync (struct bio *o)
+{
+	ssize_t len = dev_block_read (o->bio_dev, (void *) o->bio_data,
+				      o->bio_count, o->bio_offset);
+
+	if (len > 0)
+		bio_stat_io (o->bio_dev, false, len);
+
+	if (!bio_load_tail (o, len))
 		return false;
 
 	o->bio_state |= BIO_READY;
 	return true;
 }
 
+bool bio_save_sync (struct bio *o)
+{
+	if (dev_block_write (o->bio_dev, (void *) o->bio_data, o->bio_count,
+			     o->bio_offset) != o->bio_count)
+		return false;
+
+	bio_stat_io (o->bio_dev, true, o->bio_count);
+
+	o->bio_state &= ~BIO_DIRTY;
+	return true;
+}
+
+struct aio *bio_req_alloc (struct bio *o, int op)
+{
+	struct aio *r;
+
+	if ((r = pool_alloc (sizeof (*r))) == NULL)
+		return NULL;
+
+	memset (r, 0, sizeof (*r));
+
+	r->aio_fildes	  = o->bio_dev;
+	r->aio_lio_opcode = op;
+	r->aio_buf	  = o->bio_data;
+	r->aio_nbytes	  = o->bio_count;
+	r->aio_offset	  = o->bio_offset;
+	r->aio_sigevent.sigev_notify = SIGEV_NONE;
+	r->aio_sigevent.sigev_value.sival_ptr = o;  /* owner of request */
+
+	return o->bio_req = r;
+}
+
+void bio_req_free (struct bio *o)
+{
+	pool_free (o->bio_req, sizeof (*o->bio_req));
+	o->bio_req = NULL;
+}
+
+bool bio_load (struct bio *o)
+{
+	if ((o->bio_state & BIO_READY) != 0)
+		return true;
+
+	if ((o->bio_state & BIO_LOAD) == 0 && !bio_load_emit (o))
+		return false;
+
+	return (o->bio_state & BIO_LOAD) == 0 || bio_join (o);
+}
+
 bool bio_save (struct bio *o)
 {
 	if ((o->bio_state & BIO_DIRTY) == 0)
 		return true;
 
-	if (!bio_save_emit (o) || !bio_join (o))
+	if ((o->bio_state & BIO_SAVE) == 0 && !bio_save_emit (o))
 		return false;
 
-	o->bio_state &= ~BIO_DIRTY;
-	return true;
+	return (o->bio_state & BIO_SAVE) == 0 || bio_join (o);
 }
 
-struct bio *bio_read (int dev, off_t offset, size_t count)
+static bool bio_emit_one (struct bio *o, int mode)
 {
+	return mode == BIO_R ? bio_load_async (o) : bio_save_async (o);
+}
+
+static bool bio_pending (const struct bio *o, int mode)
+{
+	return mode == BIO_R ?
+	       (o->bio_state & (BIO_READY | BIO_BUSY)) == 0 :
+	       (o->bio_state & (BIO_DIRTY | BIO_BUSY)) == BIO_DIRTY;
+}
+
+bool bio_emit_many (struct bio *const v[], size_t n, int mode)
+{
+	const int op   = mode == BIO_R ? LIO_READ : LIO_WRITE;
+	const int busy = mode == BIO_R ? BIO_LOAD : BIO_SAVE;
+	struct aio **list;
 	struct bio *o;
+	size_t i, count, done;
+	bool ok = true;
+
+	if ((list = malloc (sizeof (list[0]) * n)) == NULL)
+		goto one_by_one;
+
+	for (i = 0, count = 0; i < n; ++i)
+		if (!dev_block_async (v[i]->bio_dev))
+			ok &= bio_emit_one (v[i], mode);
+		else if (!bio_pending (v[i], mode))
+			continue;
+		else if ((list[count] = bio_req_alloc (v[i], op)) != NULL)
+			++count;
+		else
+			ok = false;
+
+	done = count > 0 ? aio_submit (list, count) : 0;
+
+	/* queued requests lead the list, the rest are retried one by one */
+	for (i = 0; i < count; ++i) {
+		o = list[i]->aio_sigevent.sigev_value.sival_ptr;
+
+		if (i < done)
+			o->bio_state |= busy;
+		else {
+			bio_req_free (o);
+			ok &= bio_emit_one (o, mode);
+		}
+	}
+
+	free (list);
+	return ok;
+one_by_one:
+	for (i = 0; i < n; ++i)
+		ok &= bio_emit_one (v[i], mode);
+
+	return ok;
+}
+
+bool bio_join_many (struct bio *const v[], size_t n)
+{
+	size_t i;
+	bool ok = true;
+
+	for (i = 0; i < n; ++i)
+		if ((v[i]->bio_state & BIO_BUSY) != 0)
+			ok &= bio_join (v[i]);
+
+	return ok;
+}
+
+bool bio_load_many (struct bio *const v[], size_t n)
+{
+	size_t i;
+	bool ok;
+
+	ok = bio_emit_many (v, n, BIO_R);
+	ok &= bio_join_many (v, n);
+
+	for (i = 0; ok && i < n; ++i)
+		ok = (v[i]->bio_state & BIO_READY) != 0;
 
-	if ((o = bio_get (dev, offset, count, BIO_R)) == NULL ||
-	    bio_read_begin (o))
+	return ok;
+}
+
+bool bio_save_many (struct bio *const v[], size_t n)
+{
+	size_t i;
+	bool ok;
+
+	ok = bio_emit_many (v, n, BIO_W);
+	ok &= bio_join_many (v, n);
+
+	for (i = 0; ok && i < n; ++i)
+		ok = (v[i]->bio_state & BIO_DIRTY) == 0;
+
+	return ok;
+}
+
+struct bio *bio_read_class (int dev, off_t offset, size_t count, int mode)
+{
+	struct bio *o = bio_get (dev, offset, count, BIO_R | mode);
+
+	bio_ahead (dev, offset, count, mode);
+
+	if (o == NULL || bio_read_begin (o))
 		return o;
 
 	bio_put (o);
 	return NULL;
 }
 
+struct bio *bio_read (int dev, off_t offset, size_t count)
+{
+	return bio_read_class (dev, offset, count, 0);
+}
+
 struct bio *bio_write (int dev, off_t offset, size_t count, bool modify)
 {
 	const int mode = modify ? BIO_RW : BIO_W;
 	struct bio *o;
 
-	if ((o = bio_get (dev, offset, count, mode)) == NULL ||
-	    bio_write_begin (o, modify))
+	if ((o = bio_get (dev, offset, count, mode)) == NULL)
+		return o;
+
+	/* data around the requested range in extended block must be kept */
+	modify |= o->bio_offset != offset || o->bio_count != count;
+
+	if (bio_write_begin (o, modify))
 		return o;
 
 	bio_put (o);
@@ -118,9 +421,9 @@ bool bio_sync (struct bio *o)
 {
 	int ok;
 
-	rwlock_wrlock (&o->bio_lock);
+	lockword_wrlock (&o->bio_lock);
 	ok = bio_save (o);
-	rwlock_unlock (&o->bio_lock);
+	lockword_unlock (&o->bio_lock);
 
 	return ok;
 }
@@ -132,9 +435,50 @@ void bio_read_ahead (int dev, off_t offset, size_t count)
 	if ((o = bio_get (dev, offset, count, BIO_R)) == NULL)
 		return;
 
-	rwlock_rdlock (&o->bio_lock);
-	bio_load_async (o);
-	rwlock_unlock (&o->bio_lock);
+	if (lockword_trywrlock (&o->bio_lock)) {
+		bio_load_async (o);
+		lockword_unlock (&o->bio_lock);
+	}
 
 	bio_put (o);
 }
+
+void bio_drain (void)
+{
+	mutex_lock (&reap_lock);
+
+	while (reap_count > 0)
+		cond_wait (&reap_done, &reap_lock);
+
+	mutex_unlock (&reap_lock);
+}
+
+void bio_write_wait (int dev, off_t offset, size_t count)
+{
+	const off_t end = offset + count;
+	size_t unit = 1;
+	struct bio *o;
+
+	bio_drain ();
+
+	if (count == 0)
+		return;
+
+	dev_block_round (dev, &offset, &unit);
+
+	for (; offset < end; offset += unit) {
+		if ((o = bio_cache_peek (dev, offset)) == NULL)
+			continue;
+
+		if ((o->bio_state & BIO_SAVE) != 0) {
+			lockword_wrlock (&o->bio_lock);
+
+			if ((o->bio_state & BIO_BUSY) != 0)
+				(void) bio_join (o);  /* failure keeps it dirty */
+
+			lockword_unlock (&o->bio_lock);
+		}
+
+		bio_put (o);
+	}
+}
@@ -0,0 +1,110 @@
+/*
+ * Bitmap Scan Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <marten/bitmap.h>
+
+#define MAP_BITS	2048
+#define ROUNDS		2000
+
+static uint8_t map[MAP_BITS / 8 + 32];  /* tail to catch reads past end */
+
+static int bit (size_t i)
+{
+	return (map[i / 8] >> (i % 8)) & 1;
+}
+
+static size_t ref_next (size_t from, size_t size, int value)
+{
+	for (; from < size; ++from)
+		if (bit (from) == value)
+			return from;
+
+	return size;
+}
+
+static size_t ref_count (size_t size)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i < size; ++i)
+		count += bit (i);
+
+	return count;
+}
+
+/*
+ * Fill bitmap with runs of equal bits: long runs make whole words to be
+ * skipped, density selects the share of set bits
+ */
+static void fill (unsigned *seed, unsigned density)
+{
+	size_t i, end;
+	int value;
+
+	for (i = 0; i < MAP_BITS;) {
+		end = i + 1 + rand_r (seed) % (rand_r (seed) % 2 ? 8 : 600);
+		value = rand_r (seed) % 100 < density;
+
+		for (; i < end && i < MAP_BITS; ++i)
+			if (value)
+				map[i / 8] |=  (1 << (i % 8));
+			else
+				map[i / 8] &= ~(1 << (i % 8));
+	}
+
+	/* bits past the end must never be seen */
+	for (i = MAP_BITS / 8; i < sizeof (map); ++i)
+		map[i] = rand_r (seed);
+}
+
+static int check (size_t from, size_t size)
+{
+	if (bitmap_next_set (map, from, size) != ref_next (from, size, 1) ||
+	    bitmap_next_clear (map, from, size) != ref_next (from, size, 0)) {
+		fprintf (stderr, "E: scan from %zu of %zu bits failed\n",
+			 from, size);
+		return 0;
+	}
+
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	static const unsigned density[] = { 0, 1, 50, 99, 100 };
+	unsigned seed = 1, round, k;
+	size_t size, from;
+
+	for (round = 0; round < ROUNDS; ++round) {
+		fill (&seed, density[round % 5]);
+
+		/* the whole map with random bits past the end in the tail */
+		size = rand_r (&seed) % 2 ? MAP_BITS - rand_r (&seed) % 300 :
+					    rand_r (&seed) % MAP_BITS;
+
+		if (bitmap_count (map, size) != ref_count (size)) {
+			fprintf (stderr, "E: count of %zu bits failed\n", size);
+			return 1;
+		}
+
+		for (k = 0; k < 20; ++k) {
+			from = rand_r (&seed) % (size + 2);
+
+			if (!check (from, size))
+				return 1;
+		}
+
+		if (!check (0, size))
+			return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,193 @@
+/*
+ * Block Device Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <marten/bio.h>
+#include <marten/device/block.h>
+
+#define FILE_SIZE	65536
+#define UNIT_ORDER	13	/* 8 KiB cache unit	*/
+
+static const char *path = "dev-block-test.tmp";
+
+static int make_file (off_t size)
+{
+	char buf[FILE_SIZE];
+	int fd, ok;
+
+	if ((fd = open (path, O_RDWR | O_CREAT | O_TRUNC, 0600)) == -1)
+		return 0;
+
+	memset (buf, 'x', sizeof (buf));
+	ok = pwrite (fd, buf, size, 0) == size;
+	close (fd);
+	return ok;
+}
+
+static int read_one (int dev, off_t offset, size_t count)
+{
+	struct bio *o;
+	const char *p;
+	int ok;
+
+	if ((o = bio_read (dev, offset, count)) == NULL)
+		return 0;
+
+	p = bio_slice (o, offset);
+	ok = memcmp (p, p + 1, count - 1) == 0 && p[0] == 'x';
+
+	bio_read_end (o);
+	bio_put (o);
+	return ok;
+}
+
+/*
+ * A direct I/O block crossing the end of device is zero-filled past it,
+ * but a read stopped inside the device (here the file is truncated behind
+ * our back) must fail. File systems without direct I/O support are
+ * tested in buffered mode.
+ */
+static int check_tail (void)
+{
+	const off_t size = FILE_SIZE - 1000;
+	struct bio *o;
+	const char *p;
+	int dev, ok;
+
+	if (!make_file (size))
+		return 0;
+
+	if ((dev = dev_block_open (path, DEV_DIRECT)) == -1 &&
+	    (dev = dev_block_open (path, 0)) == -1)
+		return 0;
+
+	ok = dev_block_set_unit (dev, UNIT_ORDER) &&
+	     dev_block_size (dev) == size &&
+	     (o = bio_read (dev, size - 100, 100)) != NULL;
+
+	if (ok) {
+		p = bio_slice (o, size - 100);
+		ok = p[99] == 'x' && o->bio_offset + o->bio_count >= size &&
+		     memchr (p + 100, 'x', o->bio_offset + o->bio_count -
+					   size) == NULL;
+
+		bio_read_end (o);
+		bio_put (o);
+	}
+
+	if (!ok)
+		fprintf (stderr, "E: read at the end of device failed\n");
+
+	if (ok && truncate (path, 20000) == 0 && read_one (dev, 16384, 1024)) {
+		fprintf (stderr, "E: short read inside device succeeded\n");
+		ok = 0;
+	}
+
+	ok = ok && read_one (dev, 8192, 4096);  /* before the new end */
+
+	dev_block_close (dev);
+	return ok;
+}
+
+static int check_ram (void)
+{
+	char buf[4096];
+	int dev, ok;
+
+	if ((dev = dev_block_ram (FILE_SIZE)) == -1)
+		return 0;
+
+	memset (buf, 'x', sizeof (buf));
+
+	ok = dev_block_write (dev, buf, sizeof (buf), 4096) == sizeof (buf) &&
+	     read_one (dev, 4096, sizeof (buf)) &&
+	     dev_block_read (dev, buf, sizeof (buf), FILE_SIZE - 100) == 100 &&
+	     dev_block_write (dev, buf, sizeof (buf), FILE_SIZE) == -1;
+
+	dev_block_close (dev);
+
+	if (!ok)
+		fprintf (stderr, "E: RAM disk transfers failed\n");
+
+	return ok;
+}
+
+static int check_mmap (void)
+{
+	char *p;
+	int dev, ok;
+
+	if (!make_file (FILE_SIZE) ||
+	    (dev = dev_block_open (path, DEV_MMAP)) == -1)
+		return 0;
+
+	ok = (p = dev_block_get (dev, 100, 200, DEV_PULL)) != NULL &&
+	     p[0] == 'x' && p[199] == 'x' &&
+	     dev_block_get (dev, FILE_SIZE - 100, 200, DEV_PULL) == NULL;
+
+	if (p != NULL)
+		dev_block_put (p, 200);
+
+	dev_block_close (dev);
+
+	if (!ok)
+		fprintf (stderr, "E: mapped image access failed\n");
+
+	return ok;
+}
+
+/*
+ * Closed descriptor is reused by the next open: it must not inherit cache
+ * unit of the last user, whether that was opened device or raw descriptor
+ */
+static int no_unit (int dev)
+{
+	off_t offset = 100;
+	size_t count = 100;
+
+	dev_block_round (dev, &offset, &count);
+	return offset == 100 && count == 100;
+}
+
+static int check_reuse (void)
+{
+	int dev, fd, ok;
+
+	if (!make_file (FILE_SIZE) || (dev = dev_block_open (path, 0)) == -1)
+		return 0;
+
+	dev_block_set_unit (dev, UNIT_ORDER);
+	dev_block_close (dev);
+
+	ok = (fd = open (path, O_RDONLY)) == dev && no_unit (fd);
+
+	dev_block_set_unit (fd, UNIT_ORDER);
+	dev_block_close (fd);
+
+	ok = ok && (dev = dev_block_open (path, 0)) == fd && no_unit (dev);
+	dev_block_close (dev);
+
+	if (!ok)
+		fprintf (stderr, "E: reused descriptor inherits state\n");
+
+	return ok;
+}
+
+int main (int argc, char *argv[])
+{
+	int ok = check_tail () && check_ram () && check_mmap () &&
+		 check_reuse ();
+
+	unlink (path);
+	return ok ? 0 : 1;
+}
@@ -6,28 +6,710 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+
+#ifdef __linux__
+#include <linux/fs.h>
+#endif
+
+#include <marten/atomic.h>
+#include <marten/bio-cache.h>
+#include <marten/bool.h>
 #include <marten/device/block.h>
+#include <marten/hash.h>
+#include <marten/mutex.h>
+#include <marten/pool.h>
+
+#define DEV_PAGE_ORDER	6		/* devices per table page	*/
+#define DEV_PAGES	64		/* table pages			*/
+
+#define DEV_PAGE_SIZE	(1UL << DEV_PAGE_ORDER)
+#define DEV_MAX		(DEV_PAGES * DEV_PAGE_SIZE)
+
+/*
+ * Device state is kept in two-level tables indexed by descriptor or by
+ * handle of attached backend: pages are allocated on demand and never
+ * freed, thus lookups need no locks. Descriptors not opened with
+ * dev_block_open use default buffered mode. Slots are filled and cleared
+ * under dev_attach_lock, and a slot is cleared on close before its
+ * descriptor or handle may be reused.
+ */
+struct dev_block {
+	int		mode;
+	size_t		align;		/* I/O alignment, 0 - not opened */
+	unsigned	unit;		/* cache unit order, 0 - none	 */
+	off_t		size;		/* device size, 0 - unknown	 */
+	char		*map;		/* mapped image, DEV_MMAP only	 */
+	int		fd;
+	const struct dev_ops *ops;
+	void		*cookie;
+};
+
+static mutex_t dev_lock = MUTEX_INIT;
+static mutex_t dev_attach_lock = MUTEX_INIT;
+static struct dev_block *dev_table[2][DEV_PAGES];  /* descriptors, handles */
+
+/*
+ * Mapped devices are listed separately to let dev_block_put recognize
+ * pointers into mapped images quickly
+ */
+#define DEV_MAPS	64
+
+static struct dev_block *dev_maps[DEV_MAPS];
+static atomic_int dev_maps_count;
+
+static struct dev_block *dev_block_slot (int dev, bool create)
+{
+	const bool handle = dev < 0;
+	const unsigned i = handle ? -2 - dev : dev;  /* -1 is not valid */
+	struct dev_block **page;
+
+	if (i >= DEV_MAX)
+		return NULL;
+
+	page = dev_table[handle] + (i >> DEV_PAGE_ORDER);
+
+	if (*page == NULL && create) {
+		mutex_lock (&dev_lock);
+
+		if (*page == NULL)
+			*page = calloc (DEV_PAGE_SIZE, sizeof ((*page)[0]));
+
+		mutex_unlock (&dev_lock);
+	}
+
+	return *page == NULL ? NULL : *page + (i & (DEV_PAGE_SIZE - 1));
+}
+
+static const struct dev_block *dev_block_find (int dev)
+{
+	const struct dev_block *o = dev_block_slot (dev, false);
+
+	return o == NULL || o->ops == NULL ? NULL : o;
+}
+
+static size_t dev_block_probe_align (int dev)
+{
+	struct stat st;
+#ifdef BLKSSZGET
+	int size;
+
+	if (ioctl (dev, BLKSSZGET, &size) == 0 && size > 0)
+		return size;
+#endif
+	if (fstat (dev, &st) == 0 && st.st_blksize > 0)
+		return st.st_blksize;
+
+	return 4096;
+}
+
+static off_t dev_block_probe_size (int dev)
+{
+	struct stat st;
+#ifdef BLKGETSIZE64
+	uint64_t size;
+
+	if (ioctl (dev, BLKGETSIZE64, &size) == 0)
+		return size;
+#endif
+	return fstat (dev, &st) == 0 && S_ISREG (st.st_mode) ? st.st_size : 0;
+}
+
+/*
+ * Map whole image read-only and register the mapping
+ */
+static bool dev_block_map (struct dev_block *o, int dev)
+{
+	size_t i;
+	void *p;
+
+	if (o->size == 0 || o->size != (size_t) o->size) {
+		errno = EINVAL;
+		return false;
+	}
+
+	p = mmap (NULL, o->size, PROT_READ, MAP_SHARED, dev, 0);
+
+	if (p == MAP_FAILED)
+		return false;
+
+	mutex_lock (&dev_lock);
+
+	for (i = 0; i < DEV_MAPS && dev_maps[i] != NULL; ++i) {}
+
+	if (i < DEV_MAPS) {
+		o->map = p;
+		dev_maps[i] = o;
+
+		if (i >= dev_maps_count)
+			atomic_store_explicit (&dev_maps_count, i + 1,
+					       memory_order_release);
+	}
+
+	mutex_unlock (&dev_lock);
+
+	if (i < DEV_MAPS)
+		return true;
+
+	munmap (p, o->size);
+	errno = EMFILE;
+	return false;
+}
+
+static void dev_block_unmap (struct dev_block *o)
+{
+	size_t i;
+
+	mutex_lock (&dev_lock);
+
+	for (i = 0; i < DEV_MAPS; ++i)
+		if (dev_maps[i] == o)
+			dev_maps[i] = NULL;
+
+	mutex_unlock (&dev_lock);
+
+	munmap (o->map, o->size);
+	o->map = NULL;
+}
+
+static bool dev_block_mapped (const void *p)
+{
+	const size_t count = atomic_load_explicit (&dev_maps_count,
+						   memory_order_acquire);
+	const struct dev_block *o;
+	size_t i;
+
+	for (i = 0; i < count; ++i)
+		if ((o = dev_maps[i]) != NULL && (const char *) p >= o->map &&
+		    (const char *) p < o->map + o->size)
+			return true;
+
+	return false;
+}
+
+static void dev_block_advise_map (const struct dev_block *o, off_t offset,
+				  size_t count, int advice)
+{
+	const size_t page = sysconf (_SC_PAGESIZE);
+	off_t head;
+
+	if (offset >= o->size)
+		return;
+
+	if (count == 0 || count > o->size - offset)
+		count = o->size - offset;
+
+	head = offset & ~(off_t) (page - 1);
+	madvise (o->map + head, count + (offset - head), advice);
+}
+
+/*
+ * Descriptor backend
+ */
+static ssize_t dev_file_read (void *cookie, void *buf, size_t count, off_t pos)
+{
+	const struct dev_block *o = cookie;
+
+	return pread (o->fd, buf, count, pos);
+}
+
+static ssize_t
+dev_file_write (void *cookie, const void *buf, size_t count, off_t pos)
+{
+	const struct dev_block *o = cookie;
+
+	return pwrite (o->fd, buf, count, pos);
+}
+
+static ssize_t
+dev_file_readv (void *cookie, const struct iovec *iov, int n, off_t pos)
+{
+	const struct dev_block *o = cookie;
+
+	return preadv (o->fd, iov, n, pos);
+}
+
+static ssize_t
+dev_file_writev (void *cookie, const struct iovec *iov, int n, off_t pos)
+{
+	const struct dev_block *o = cookie;
+
+	return pwritev (o->fd, iov, n, pos);
+}
+
+static int dev_file_flush (void *cookie)
+{
+	const struct dev_block *o = cookie;
+
+	return fdatasync (o->fd);
+}
+
+static void dev_file_prefetch (void *cookie, off_t pos, size_t count)
+{
+	const struct dev_block *o = cookie;
+
+	posix_fadvise (o->fd, pos, count, POSIX_FADV_WILLNEED);
+}
+
+static void dev_file_close (void *cookie)
+{
+	const struct dev_block *o = cookie;
+
+	close (o->fd);
+}
+
+static const struct dev_ops dev_file_ops = {
+	.read		= dev_file_read,
+	.write		= dev_file_write,
+	.readv		= dev_file_readv,
+	.writev		= dev_file_writev,
+	.flush		= dev_file_flush,
+	.prefetch	= dev_file_prefetch,
+	.close		= dev_file_close,
+};
+
+/*
+ * Read-only mapped image backend
+ */
+static ssize_t dev_mmap_read (void *cookie, void *buf, size_t count, off_t pos)
+{
+	const struct dev_block *o = cookie;
+
+	if (pos >= o->size)
+		return 0;
+
+	if (count > o->size - pos)
+		count = o->size - pos;
+
+	memcpy (buf, o->map + pos, count);
+	return count;
+}
+
+static ssize_t
+dev_mmap_readv (void *cookie, const struct iovec *iov, int n, off_t pos)
+{
+	ssize_t len, total = 0;
+	int i;
+
+	for (i = 0; i < n; ++i, pos += len, total += len)
+		if ((len = dev_mmap_read (cookie, iov[i].iov_base,
+					  iov[i].iov_len, pos)) < iov[i].iov_len)
+			return total + len;
+
+	return total;
+}
+
+static void dev_mmap_prefetch (void *cookie, off_t pos, size_t count)
+{
+	dev_block_advise_map (cookie, pos, count, MADV_WILLNEED);
+}
+
+static void dev_mmap_close (void *cookie)
+{
+	struct dev_block *o = cookie;
+
+	dev_block_unmap (o);
+	close (o->fd);
+}
+
+static const struct dev_ops dev_mmap_ops = {
+	.read		= dev_mmap_read,
+	.write		= dev_file_write,
+	.readv		= dev_mmap_readv,
+	.writev		= dev_file_writev,
+	.flush		= dev_file_flush,
+	.prefetch	= dev_mmap_prefetch,
+	.close		= dev_mmap_close,
+};
+
+int dev_block_open (const char *path, int mode)
+{
+	int flags = (mode & DEV_WRITE) != 0 ? O_RDWR : O_RDONLY;
+	struct dev_block *o;
+	int dev;
 
+	if ((mode & DEV_MMAP) != 0 && (mode & (DEV_WRITE | DEV_DIRECT)) != 0) {
+		errno = EINVAL;
+		return -1;
+	}
+#ifdef O_DIRECT
+	if ((mode & DEV_DIRECT) != 0)
+		flags |= O_DIRECT;
+#endif
+	if ((dev = open (path, flags)) == -1)
+		return dev;
+
+	if ((o = dev_block_slot (dev, true)) == NULL)
+		goto no_slot;
+
+	mutex_lock (&dev_attach_lock);  /* wait for close of last user */
+	memset (o, 0, sizeof (*o));	/* nothing inherited from it	*/
+
+	o->mode   = mode;
+	o->align  = (mode & DEV_DIRECT) != 0 ? dev_block_probe_align (dev) : 1;
+	o->size   = dev_block_probe_size (dev);
+	o->fd     = dev;
+	o->ops    = (mode & DEV_MMAP) != 0 ? &dev_mmap_ops : &dev_file_ops;
+	o->cookie = o;
+
+	if ((mode & DEV_MMAP) != 0 && !dev_block_map (o, dev))
+		goto no_map;
+
+	mutex_unlock (&dev_attach_lock);
+	return dev;
+no_map:
+	memset (o, 0, sizeof (*o));
+	mutex_unlock (&dev_attach_lock);
+no_slot:
+	close (dev);
+	return -1;
+}
+
+/*
+ * Write back delayed writes and drop cached blocks of device before the
+ * descriptor can be reused
+ */
+void dev_block_close (int dev)
+{
+	struct dev_block *o = dev_block_slot (dev, false);
+
+	if (o != NULL && (o->mode & DEV_WRITE) != 0)
+		bio_sync_dev (dev);
+
+	bio_sync_release (dev);
+	bio_cache_purge (dev);
+	bio_drain ();
+	bio_stat_release (dev);
+
+	/* clear slot before descriptor number may be reused */
+	if (o == NULL || o->ops == NULL) {
+		if (o != NULL)
+			memset (o, 0, sizeof (*o));
+
+		close (dev);
+		return;
+	}
+
+	mutex_lock (&dev_attach_lock);
+	o->ops->close (o->cookie);
+	memset (o, 0, sizeof (*o));
+	mutex_unlock (&dev_attach_lock);
+}
+
+int dev_block_attach (const struct dev_ops *ops, void *cookie, off_t size)
+{
+	struct dev_block *o;
+	int dev;
+
+	mutex_lock (&dev_attach_lock);
+
+	for (dev = -2; (o = dev_block_slot (dev, true)) != NULL; --dev)
+		if (o->ops == NULL) {
+			o->mode   = DEV_WRITE;
+			o->align  = 1;
+			o->unit   = 0;
+			o->size   = size;
+			o->map    = NULL;
+			o->fd     = -1;
+			o->ops    = ops;
+			o->cookie = cookie;
+			break;
+		}
+
+	mutex_unlock (&dev_attach_lock);
+
+	if (o != NULL)
+		return dev;
+
+	errno = EMFILE;
+	return -1;
+}
+
+ssize_t dev_block_read (int dev, void *buf, size_t count, off_t offset)
+{
+	const struct dev_block *o = dev_block_find (dev);
+
+	return	o == NULL ? pread (dev, buf, count, offset) :
+		o->ops->read (o->cookie, buf, count, offset);
+}
+
+ssize_t dev_block_write (int dev, const void *buf, size_t count, off_t offset)
+{
+	const struct dev_block *o = dev_block_find (dev);
+
+	return	o == NULL ? pwrite (dev, buf, count, offset) :
+		o->ops->write (o->cookie, buf, count, offset);
+}
+
+ssize_t dev_block_readv (int dev, const struct iovec *iov, int n, off_t offset)
+{
+	const struct dev_block *o = dev_block_find (dev);
+
+	return	o == NULL ? preadv (dev, iov, n, offset) :
+		o->ops->readv (o->cookie, iov, n, offset);
+}
+
+ssize_t
+dev_block_writev (int dev, const struct iovec *iov, int n, off_t offset)
+{
+	const struct dev_block *o = dev_block_find (dev);
+
+	return	o == NULL ? pwritev (dev, iov, n, offset) :
+		o->ops->writev (o->cookie, iov, n, offset);
+}
+
+int dev_block_flush (int dev)
+{
+	const struct dev_block *o = dev_block_find (dev);
+
+	return o == NULL ? fdatasync (dev) : o->ops->flush (o->cookie);
+}
+
+/*
+ * Prefetch requests go to backend, other hints are passed to the system
+ * for mapped images and descriptors only
+ */
+void dev_block_advise (int dev, off_t offset, size_t count, int advice)
+{
+	const struct dev_block *o = dev_block_find (dev);
+
+	if (advice == DEV_ADV_WILLNEED && o != NULL)
+		o->ops->prefetch (o->cookie, offset, count);
+	else if (o != NULL && o->map != NULL)
+		dev_block_advise_map (o, offset, count,
+				      advice == DEV_ADV_RANDOM   ? MADV_RANDOM :
+				      advice == DEV_ADV_SEQ      ? MADV_SEQUENTIAL :
+				      advice == DEV_ADV_WILLNEED ? MADV_WILLNEED :
+								   MADV_NORMAL);
+	else if (dev >= 0)
+		posix_fadvise (dev, offset, count,
+			       advice == DEV_ADV_RANDOM   ? POSIX_FADV_RANDOM :
+			       advice == DEV_ADV_SEQ      ? POSIX_FADV_SEQUENTIAL :
+			       advice == DEV_ADV_WILLNEED ? POSIX_FADV_WILLNEED :
+							    POSIX_FADV_NORMAL);
+}
+
+size_t dev_block_align (int dev)
+{
+	const struct dev_block *o = dev_block_slot (dev, false);
+
+	return o == NULL || o->align == 0 ? 1 : o->align;
+}
+
+off_t dev_block_size (int dev)
+{
+	const struct dev_block *o = dev_block_slot (dev, false);
+
+	if (o != NULL && o->size > 0)
+		return o->size;
+
+	return dev >= 0 ? dev_block_probe_size (dev) : 0;
+}
+
+bool dev_block_set_unit (int dev, unsigned order)
+{
+	struct dev_block *o = dev_block_slot (dev, true);
+
+	if (o == NULL)
+		return false;
+
+	if (o->ops == NULL || dev >= 0)
+		o->size = dev_block_probe_size (dev);
+
+	o->unit = order;
+	return true;
+}
+
+/*
+ * A request that fits into one cache unit is extended to the whole unit
+ * (but not past the end of device), then the range is aligned for direct
+ * I/O
+ */
+void dev_block_round (int dev, off_t *offset, size_t *count)
+{
+	const struct dev_block *o = dev_block_slot (dev, false);
+	off_t head = *offset, tail = *offset + *count, mask;
+
+	if (o == NULL || *count == 0)
+		return;
+
+	if (o->unit > 0) {
+		mask = ((off_t) 1 << o->unit) - 1;
+
+		if ((head & ~mask) == ((tail - 1) & ~mask)) {
+			head &= ~mask;
+
+			if (o->size == 0 || head + mask < o->size)
+				tail = head + mask + 1;
+			else if (tail < o->size)
+				tail = o->size;
+		}
+	}
+
+	if (o->align > 1) {
+		mask = o->align - 1;
+		head &= ~mask;
+		tail = (tail + mask) & ~mask;
+	}
+
+	*offset = head;
+	*count  = tail - head;
+}
+
+/*
+ * Data returned by dev_block_get is a slice of cached block: the slice
+ * table maps returned pointers to their blocks, every entry holds one
+ * reference to its block. Buffers allocated without pull are private and
+ * not in the table.
+ */
+#define DEV_SLICE_ORDER	8
+#define DEV_SLICE_SIZE	(1UL << DEV_SLICE_ORDER)
+
+struct dev_slice {
+	struct dev_slice	*next;
+	const void		*data;
+	struct bio		*block;
+};
+
+static mutex_t slice_lock[DEV_SLICE_SIZE] = {
+	[0 ... DEV_SLICE_SIZE - 1] = MUTEX_INIT,
+};
+
+static struct dev_slice *slice[DEV_SLICE_SIZE];
+
+static size_t dev_slice_index (const void *data)
+{
+	const uint64_t key = (uintptr_t) data;
+	uint32_t iv = 0;
+
+	iv = oat_hash_step (iv, key);
+	iv = oat_hash_step (iv, key >> 32);
+
+	return oat_hash_final (iv) & (DEV_SLICE_SIZE - 1);
+}
+
+static bool dev_slice_add (const void *data, struct bio *block)
+{
+	const size_t i = dev_slice_index (data);
+	struct dev_slice *o;
+
+	if ((o = pool_alloc (sizeof (*o))) == NULL)
+		return false;
+
+	o->data  = data;
+	o->block = block;
+
+	mutex_lock (slice_lock + i);
+	o->next  = slice[i];
+	slice[i] = o;
+	mutex_unlock (slice_lock + i);
+	return true;
+}
+
+static struct bio *dev_slice_del (const void *data)
+{
+	const size_t i = dev_slice_index (data);
+	struct dev_slice **p, *o;
+	struct bio *block = NULL;
+
+	mutex_lock (slice_lock + i);
+
+	for (p = slice + i; (o = *p) != NULL; p = &o->next)
+		if (o->data == data) {
+			*p = o->next;
+			break;
+		}
+
+	mutex_unlock (slice_lock + i);
+
+	if (o != NULL) {
+		block = o->block;
+		pool_free (o, sizeof (*o));
+	}
+
+	return block;
+}
+
+static int dev_pull_mode (int pull)
+{
+	return	((pull & DEV_META) != 0 ? BIO_META : 0) |
+		((pull & DEV_PIN)  != 0 ? BIO_PIN  : 0);
+}
+
+/*
+ * The data of cached blocks is shared by all readers and must not be
+ * modified
+ */
 void *dev_block_get (int dev, off_t offset, size_t count, int pull)
 {
-	void *o;
+	const struct dev_block *m = dev_block_slot (dev, false);
+	struct bio *o;
+	void *data;
+	int mode;
+
+	if ((pull & DEV_PULL) == 0)
+		return pool_alloc (count);
+
+	if (m != NULL && m->map != NULL)  /* zero-copy access to image */
+		return offset >= 0 && offset <= m->size &&
+		       count <= m->size - offset ? m->map + offset : NULL;
 
-	if ((o = malloc (count)) == NULL)
-		return o;
+	mode = dev_pull_mode (pull);
 
-	if (pull && pread (dev, o, count, offset) != count)
-		goto no_read;
+	if ((o = bio_read_class (dev, offset, count, mode)) == NULL)
+		return NULL;
 
-	return o;
-no_read:
-	free (o);
+	bio_read_end (o);
+	data = bio_slice (o, offset);
+
+	if (dev_slice_add (data, o))
+		return data;
+
+	bio_put (o);
 	return NULL;
 }
 
+bool dev_block_get_many (int dev, off_t offset, size_t count, size_t n,
+			 int pull, void *v[])
+{
+	const struct dev_block *m = dev_block_slot (dev, false);
+	const off_t end = offset + (off_t) (count * n);
+	size_t i;
+
+	if ((pull & DEV_PULL) != 0 && (m == NULL || m->map == NULL))
+		bio_prefetch (dev, offset, end, count, dev_pull_mode (pull));
+
+	for (i = 0; i < n; ++i, offset += count)
+		if ((v[i] = dev_block_get (dev, offset, count, pull)) == NULL)
+			goto no_block;
+
+	return true;
+no_block:
+	while (i > 0)
+		dev_block_put (v[--i], count);
+
+	return false;
+}
+
 void dev_block_put (void *o, size_t count)
 {
-	free (o);
+	struct bio *block;
+
+	if (dev_block_mapped (o))
+		return;
+
+	if ((block = dev_slice_del (o)) != NULL)
+		bio_put (block);
+	else
+		pool_free (o, count);
 }
@@ -0,0 +1,137 @@
+/*
+ * Marten Device Block, RAM Disk Backend
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#include <marten/device/block.h>
+
+/*
+ * Disk data is anonymous mapping, thus pages are allocated on first write
+ * and never touched parts of the disk cost nothing
+ */
+struct dev_ram {
+	char	*data;
+	size_t	size;
+};
+
+static size_t dev_ram_span (const struct dev_ram *o, size_t count, off_t pos)
+{
+	if (pos < 0 || pos >= o->size)
+		return 0;
+
+	return count < o->size - pos ? count : o->size - pos;
+}
+
+static ssize_t dev_ram_read (void *cookie, void *buf, size_t count, off_t pos)
+{
+	const struct dev_ram *o = cookie;
+
+	count = dev_ram_span (o, count, pos);
+	memcpy (buf, o->data + pos, count);
+	return count;
+}
+
+static ssize_t
+dev_ram_write (void *cookie, const void *buf, size_t count, off_t pos)
+{
+	struct dev_ram *o = cookie;
+
+	if ((count = dev_ram_span (o, count, pos)) == 0) {
+		errno = ENOSPC;
+		return -1;
+	}
+
+	memcpy (o->data + pos, buf, count);
+	return count;
+}
+
+static ssize_t
+dev_ram_readv (void *cookie, const struct iovec *iov, int n, off_t pos)
+{
+	ssize_t len, total = 0;
+	int i;
+
+	for (i = 0; i < n; ++i, pos += len, total += len)
+		if ((len = dev_ram_read (cookie, iov[i].iov_base,
+					 iov[i].iov_len, pos)) < iov[i].iov_len)
+			return total + len;
+
+	return total;
+}
+
+static ssize_t
+dev_ram_writev (void *cookie, const struct iovec *iov, int n, off_t pos)
+{
+	ssize_t len, total = 0;
+	int i;
+
+	for (i = 0; i < n; ++i, pos += len, total += len)
+		if ((len = dev_ram_write (cookie, iov[i].iov_base,
+					  iov[i].iov_len, pos)) < 0)
+			return total > 0 ? total : len;
+		else if (len < iov[i].iov_len)
+			return total + len;
+
+	return total;
+}
+
+static int dev_ram_flush (void *cookie)
+{
+	return 0;
+}
+
+static void dev_ram_prefetch (void *cookie, off_t pos, size_t count)
+{
+}
+
+static void dev_ram_close (void *cookie)
+{
+	struct dev_ram *o = cookie;
+
+	munmap (o->data, o->size);
+	free (o);
+}
+
+static const struct dev_ops dev_ram_ops = {
+	.read		= dev_ram_read,
+	.write		= dev_ram_write,
+	.readv		= dev_ram_readv,
+	.writev		= dev_ram_writev,
+	.flush		= dev_ram_flush,
+	.prefetch	= dev_ram_prefetch,
+	.close		= dev_ram_close,
+};
+
+int dev_block_ram (size_t size)
+{
+	struct dev_ram *o;
+	int dev;
+
+	if ((o = malloc (sizeof (*o))) == NULL)
+		return -1;
+
+	o->size = size;
+	o->data = mmap (NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (o->data == MAP_FAILED)
+		goto no_data;
+
+	if ((dev = dev_block_attach (&dev_ram_ops, o, size)) != -1)
+		return dev;
+
+	munmap (o->data, size);
+no_data:
+	free (o);
+	return -1;
+}
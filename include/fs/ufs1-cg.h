@@ -10,6 +10,7 @@
 #define FS_UFS1_CG_H  1
 
 #include <fs/ufs1-sb.h>
+#include <marten/bitmap.h>
 
 struct ufs1_cg {
 	struct ufs1_sb *sb;
@@ -34,6 +35,35 @@ static inline uint8_t *ufs1_cg_fmap (const struct ufs1_cg *o)
 	return o->data + o->fmap_pos;		/* [(fpg + 7) / 8] */
 }
 
+/*
+ * Count free inodes and free fragments by maps of cylinder group
+ */
+static inline uint32_t ufs1_cg_ifree (const struct ufs1_cg *o)
+{
+	return o->ipg - bitmap_count (ufs1_cg_imap (o), o->ipg);
+}
+
+static inline uint32_t ufs1_cg_ffree (const struct ufs1_cg *o)
+{
+	return bitmap_count (ufs1_cg_fmap (o), o->fpg);
+}
+
+/*
+ * Visit all cylinder groups of file system with a pool of threads (zero
+ * selects one per online CPU): visit is called in worker threads with
+ * group loaded into worker own descriptor, or with NULL if the group is
+ * not valid, and its result is passed to done, which is called in the
+ * calling thread strictly in order of groups. Returns zero if the pool
+ * cannot be set up.
+ */
+typedef void *ufs1_cg_visit_fn (void *cookie, uint32_t cgx,
+				const struct ufs1_cg *c);
+typedef void  ufs1_cg_done_fn  (void *cookie, uint32_t cgx, void *result);
+
+int ufs1_cg_visit (struct ufs1_sb *sb, unsigned threads,
+		   ufs1_cg_visit_fn *visit, ufs1_cg_done_fn *done,
+		   void *cookie);
+
 static inline uint32_t ufs1_cg_ino (const struct ufs1_cg *o, uint32_t i)
 {
 	return o->ipg * o->cgx + i;
@@ -9,13 +9,70 @@
 #ifndef MARTEN_AIO_H
 #define MARTEN_AIO_H  1
 
-#ifdef __unix__
+#if defined (__linux__) && defined (MARTEN_AIO_URING)
+#include <aio.h>
+#include <signal.h>
+#include <sys/types.h>
+
+#include <marten/atomic.h>
+#include <marten/bool.h>
+
+/*
+ * Linux io_uring backend: requests are queued to a shared submission ring,
+ * completions are reaped in batches by a helper thread. The subset of the
+ * POSIX aiocb interface is provided, SIGEV_THREAD notification supported.
+ * If the kernel refuses to set up a ring or does not support plain read
+ * and write operations, requests are passed to POSIX AIO.
+ */
+#define aio		aio_uring
+#define aio_read	aio_uring_read
+#define aio_write	aio_uring_write
+#define aio_join	aio_uring_join
+#define aio_pending	aio_uring_pending
+#define aio_wait	aio_uring_wait
+#define aio_submit	aio_uring_submit
+
+struct aio {
+	int		aio_fildes;
+	int		aio_lio_opcode;
+	volatile void	*aio_buf;
+	size_t		aio_nbytes;
+	off_t		aio_offset;
+	struct sigevent	aio_sigevent;
+
+	ssize_t		aio_result;	/* private: request status	*/
+	atomic_int	aio_done;	/* private: request completed	*/
+	struct aiocb	aio_cb;		/* private: POSIX AIO fallback	*/
+};
+
+int aio_read  (struct aio *o);
+int aio_write (struct aio *o);
+ssize_t aio_join (const struct aio *o);
+bool aio_pending (const struct aio *o);
+
+/*
+ * Wait until some of requests completed or timeout expired, NULL timeout
+ * waits without limit
+ */
+void aio_wait (const struct aio *const v[], size_t n,
+	       const struct timespec *timeout);
+
+/*
+ * Submit a batch of requests with opcodes set in aio_lio_opcode, returns
+ * the number of requests queued, these are moved to the head of list and
+ * the rest to its tail, errno is set if it is less than requested
+ */
+size_t aio_submit (struct aio *v[], size_t n);
+
+#elif defined (__unix__)
 #include <unistd.h>
 
 #ifdef _POSIX_ASYNCHRONOUS_IO
 #include <errno.h>
 #include <aio.h>
 
+#include <marten/bool.h>
+
 #define aio	aiocb
 
 static inline ssize_t aio_join (const struct aio *o)
@@ -26,8 +83,72 @@ static inline ssize_t aio_join (const struct aio *o)
 	return aio_return ((void *) o);
 }
 
+/*
+ * Check whether request is still in progress, never waits
+ */
+static inline bool aio_pending (const struct aio *o)
+{
+	return aio_error (o) == EINPROGRESS;
+}
+
+/*
+ * Wait until some of requests completed or timeout expired, NULL timeout
+ * waits without limit
+ */
+static inline void aio_wait (const struct aio *const v[], size_t n,
+			     const struct timespec *timeout)
+{
+	(void) aio_suspend (v, n, timeout);
+}
+
+/*
+ * A failed lio_listio may have queued some of requests already, requests
+ * refused for lack of resources are moved to the tail of list, returns
+ * the number of queued ones
+ */
+static inline size_t aio_sort_queued (struct aio *v[], size_t n)
+{
+	const int error = errno;
+	struct aio *o;
+	size_t i, done;
+
+	for (i = 0, done = 0; i < n; ++i)
+		if (aio_error (v[i]) != EAGAIN) {
+			o = v[done];
+			v[done++] = v[i];
+			v[i] = o;
+		}
+
+	errno = error;
+	return done;
+}
+
+/*
+ * Submit a batch of requests with opcodes set in aio_lio_opcode, returns
+ * the number of requests queued, these are moved to the head of list and
+ * the rest to its tail, errno is set if it is less than requested. Failed
+ * requests that were queued are reported by aio_join.
+ */
+static inline size_t aio_submit (struct aio *v[], size_t n)
+{
+	size_t done = 0, count, queued;
+
+	for (; done < n; done += count) {
+#ifdef AIO_LISTIO_MAX
+		count = n - done < AIO_LISTIO_MAX ? n - done : AIO_LISTIO_MAX;
+#else
+		count = n - done;
+#endif
+		if (lio_listio (LIO_NOWAIT, v + done, count, NULL) != 0 &&
+		    (queued = aio_sort_queued (v + done, count)) < count)
+			return done + queued;
+	}
+
+	return n;
+}
+
 #endif  /* _POSIX_ASYNCHRONOUS_IO */
-#endif  /* __unix__ */
+#endif  /* io_uring or __unix__ */
 
 #ifndef aio
 #error "Unsupported platform"
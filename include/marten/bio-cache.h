@@ -11,7 +11,32 @@
 
 #include <marten/bio.h>
 
-struct bio *bio_cache_pull (int dev, off_t offset, size_t count);
-void bio_cache_push (struct bio *o);
+/*
+ * Lookup block at least count bytes long, the hit of higher class
+ * promotes the block to this class. The bio_cache_push inserts new block
+ * unless a block long enough is cached at its offset already, returns the
+ * block in cache referenced for the caller: the new one, or the old one if
+ * the new one lost the race and must be freed by the caller.
+ */
+struct bio *bio_cache_pull (int dev, off_t offset, size_t count, int class);
+struct bio *bio_cache_push (struct bio *o);
+
+/*
+ * Lookup block at offset without counting the access and moving it in
+ * replacement queues
+ */
+struct bio *bio_cache_peek (int dev, off_t offset);
+
+/*
+ * Set the maximum total size of cached blocks of given class in bytes,
+ * blocks that do not fit are evicted immediately
+ */
+void bio_cache_limit (int class, size_t limit);
+
+/*
+ * Drop all blocks of device from the cache, blocks in use stay valid for
+ * their holders
+ */
+void bio_cache_purge (int dev);
 
 #endif  /* MARTEN_BIO_CACHE_H */
@@ -0,0 +1,67 @@
+/*
+ * Block Device I/O Statistics
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef MARTEN_BIO_STAT_H
+#define MARTEN_BIO_STAT_H  1
+
+#include <stdint.h>
+#include <time.h>
+
+#include <marten/bool.h>
+
+#define BIO_STAT_HIT		0	/* cache lookup hits		*/
+#define BIO_STAT_MISS		1	/* cache lookup misses		*/
+#define BIO_STAT_EVICT		2	/* blocks evicted from cache	*/
+#define BIO_STAT_READ		3	/* read requests completed	*/
+#define BIO_STAT_WRITE		4	/* write requests completed	*/
+#define BIO_STAT_READ_BYTES	5
+#define BIO_STAT_WRITE_BYTES	6
+#define BIO_STAT_READ_WAIT	7	/* time waiting for reads, ns	*/
+#define BIO_STAT_WRITE_WAIT	8	/* time waiting for writes, ns	*/
+#define BIO_STAT_COUNT		9
+
+#define BIO_STAT_ORDERS		32	/* wait histogram buckets	*/
+
+/*
+ * Statistics snapshot of device: bucket i of wait histogram counts waits
+ * for request completion lasted from 2^i to 2^(i + 1) nanoseconds, the
+ * bucket zero also counts waits shorter than one nanosecond
+ */
+struct bio_stat {
+	uint64_t	count[BIO_STAT_COUNT];
+	uint64_t	read_wait[BIO_STAT_ORDERS];
+	uint64_t	write_wait[BIO_STAT_ORDERS];
+};
+
+/*
+ * Counters are split into shards selected by thread and aggregated on
+ * snapshot, thus updates are cheap and do not contend
+ */
+void bio_stat_add  (int dev, int counter, uint64_t value);
+void bio_stat_io   (int dev, bool write, uint64_t bytes);
+void bio_stat_wait (int dev, bool write, uint64_t ns);
+
+/*
+ * The bio_stat_snapshot returns false if there are no statistics for
+ * device: it did no I/O since it was opened, or the table of devices was
+ * full. The bio_stat_release drops statistics of device and frees its
+ * slot, it is called on device close.
+ */
+bool bio_stat_snapshot (int dev, struct bio_stat *o);
+void bio_stat_reset    (int dev);
+void bio_stat_release  (int dev);
+
+static inline uint64_t bio_stat_now (void)
+{
+	struct timespec ts;
+
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+#endif  /* MARTEN_BIO_STAT_H */
@@ -9,49 +9,155 @@
 #ifndef MARTEN_BIO_H
 #define MARTEN_BIO_H  1
 
+#include <string.h>
+
 #include <marten/aio.h>
 #include <marten/atomic.h>
+#include <marten/bio-stat.h>
 #include <marten/bool.h>
-#include <marten/rwlock.h>
+#include <marten/device/block.h>
+#include <marten/lockword.h>
 
 #define BIO_R		1
 #define BIO_W		2
 #define BIO_RW		(BIO_R | BIO_W)
+#define BIO_META	4		/* metadata cache class		*/
+#define BIO_PIN		8		/* pin block in cache		*/
+
+#define BIO_CLASS_DATA	0
+#define BIO_CLASS_META	1
+#define BIO_CLASS_PIN	2
+#define BIO_CLASSES	3
 
 #define BIO_READY	(1 << 0)	/* actual data available	*/
 #define BIO_DIRTY	(1 << 1)	/* data modified in-core	*/
+#define BIO_LOAD	(1 << 2)	/* read request is in flight	*/
+#define BIO_SAVE	(1 << 3)	/* write request is in flight	*/
+#define BIO_BUSY	(BIO_LOAD | BIO_SAVE)
 
+/*
+ * Cached block carries only compact header, the control block of request
+ * is allocated from pool while the request is in flight. The state is
+ * changed under exclusive lock of block, but it is atomic to let it be
+ * checked without lock.
+ */
 struct bio {
-	rwlock_t	bio_lock;
+	void		*bio_data;
+	off_t		bio_offset;
+	size_t		bio_count;
+	struct aio	*bio_req;		/* request in flight	*/
 	atomic_t	bio_ref;
-	int		bio_state;
-	struct aio	bio_cb;
-};
+	int		bio_dev;
+	atomic_int	bio_state;
+	lockword_t	bio_lock;
 
-#define bio_dev		bio_cb.aio_fildes
-#define bio_data	bio_cb.aio_buf
-#define bio_count	bio_cb.aio_nbytes
-#define bio_offset	bio_cb.aio_offset
+	struct bio	*bio_hnext;		/* cache hash chain	*/
+	struct bio	*bio_cnext, *bio_cprev;	/* cache clock ring	*/
+	struct bio	*bio_dnext;		/* device dirty list	*/
+	size_t		bio_stamp;		/* cache insertion tick	*/
+	unsigned char	bio_used;		/* cache reference bit	*/
+	unsigned char	bio_class;		/* cache priority class	*/
+	unsigned char	bio_queue;		/* cache queue in class	*/
+	bool		bio_queued;		/* on device dirty list	*/
+};
 
 /*
  * Low-Level API
  */
 
+/*
+ * Devices without descriptor are not supported by AIO engine, requests
+ * to them are completed synchronously
+ */
+bool bio_load_sync (struct bio *o);
+bool bio_save_sync (struct bio *o);
+
+/*
+ * Check length of completed read: aligned blocks may extend past the end
+ * of device, the rest of a read stopped there is zero-filled. A short read
+ * inside the device is an error.
+ */
+bool bio_load_tail (struct bio *o, ssize_t len);
+
+struct aio *bio_req_alloc (struct bio *o, int op);
+void bio_req_free (struct bio *o);
+
 static inline bool bio_load_emit (struct bio *o)
 {
-	return aio_read (&o->bio_cb) == 0;
+	if (!dev_block_async (o->bio_dev))
+		return bio_load_sync (o);
+
+	if (bio_req_alloc (o, LIO_READ) == NULL)
+		return false;
+
+	if (aio_read (o->bio_req) != 0) {
+		bio_req_free (o);
+		return false;
+	}
+
+	o->bio_state |= BIO_LOAD;
+	return true;
 }
 
 static inline bool bio_save_emit (struct bio *o)
 {
-	return aio_write (&o->bio_cb) == 0;
+	if (!dev_block_async (o->bio_dev))
+		return bio_save_sync (o);
+
+	if (bio_req_alloc (o, LIO_WRITE) == NULL)
+		return false;
+
+	if (aio_write (o->bio_req) != 0) {
+		bio_req_free (o);
+		return false;
+	}
+
+	o->bio_state |= BIO_SAVE;
+	return true;
 }
 
+/*
+ * Wait for the request in flight: a completed read makes data ready, a
+ * completed write makes it clean
+ */
 static inline bool bio_join (struct bio *o)
 {
-	return aio_join (&o->bio_cb) == o->bio_count;
+	const int state = o->bio_state;
+	const bool write = (state & BIO_SAVE) != 0;
+	const uint64_t start = bio_stat_now ();
+	ssize_t len;
+
+	o->bio_state &= ~BIO_BUSY;
+	len = aio_join (o->bio_req);
+	bio_req_free (o);
+	bio_stat_wait (o->bio_dev, write, bio_stat_now () - start);
+
+	if (len > 0)
+		bio_stat_io (o->bio_dev, write, len);
+
+	if (write ? len != o->bio_count : !bio_load_tail (o, len))
+		return false;
+
+	if ((state & BIO_LOAD) != 0)
+		o->bio_state |= BIO_READY;
+
+	if ((state & BIO_SAVE) != 0)
+		o->bio_state &= ~BIO_DIRTY;
+
+	return true;
 }
 
+/*
+ * Batched requests: bio_emit_many submits reads of blocks not ready yet
+ * (mode = BIO_R) or writes of dirty blocks (mode = BIO_W) with one call,
+ * bio_join_many waits for all requests in flight.
+ */
+bool bio_emit_many (struct bio *const v[], size_t n, int mode);
+bool bio_join_many (struct bio *const v[], size_t n);
+
+bool bio_load_many (struct bio *const v[], size_t n);
+bool bio_save_many (struct bio *const v[], size_t n);
+
 static inline struct bio *bio_ref (struct bio *o)
 {
 	atomic_fetch_add_explicit (&o->bio_ref, 1, memory_order_relaxed);
@@ -63,14 +169,34 @@ struct bio *bio_get (int dev, off_t offset, size_t count, int mode);
 bool bio_load (struct bio *o);
 bool bio_save (struct bio *o);
 
+/*
+ * Check without lock whether data of block is loaded already
+ */
+static inline bool bio_ready (const struct bio *o)
+{
+	return (atomic_load_explicit (&o->bio_state, memory_order_acquire) &
+		BIO_READY) != 0;
+}
+
 static inline bool bio_load_async (struct bio *o)
 {
-	return (o->bio_state & BIO_READY) != 0 || bio_load_emit (o);
+	return (o->bio_state & (BIO_READY | BIO_BUSY)) != 0 ||
+	       bio_load_emit (o);
 }
 
 static inline bool bio_save_async (struct bio *o)
 {
-	return (o->bio_state & BIO_DIRTY) == 0 || bio_save_emit (o);
+	return (o->bio_state & BIO_DIRTY) == 0 ||
+	       (o->bio_state & BIO_SAVE) != 0 || bio_save_emit (o);
+}
+
+/*
+ * Blocks of direct I/O devices may start before the requested offset,
+ * bio_slice returns pointer to the data at given device offset
+ */
+static inline void *bio_slice (const struct bio *o, off_t offset)
+{
+	return (void *) o->bio_data + (offset - o->bio_offset);
 }
 
 /*
@@ -83,31 +209,115 @@ void bio_put  (struct bio *o);
 bool bio_sync (struct bio *o);
 void bio_read_ahead (int dev, off_t offset, size_t count);
 
+/*
+ * Read block into cache class selected by mode: BIO_META keeps metadata
+ * out of reach of data streaming, BIO_PIN pins block while pinned budget
+ * allows
+ */
+struct bio *bio_read_class (int dev, off_t offset, size_t count, int mode);
+
+/*
+ * Adaptive read-ahead: bio_read reports every read to bio_ahead, which
+ * detects sequential streams and prefetches ahead of them into cache
+ * class selected by mode with window growing up to the limit set by
+ * bio_ahead_limit (zero disables). Synchronous devices are not read ahead.
+ */
+void bio_ahead (int dev, off_t offset, size_t count, int mode);
+void bio_ahead_limit (size_t max);
+
+/*
+ * Request blocks of given size in range [from, to) into cache class
+ * selected by mode with batched submission, blocks in use are skipped.
+ * Prefetched blocks are never pinned: BIO_PIN selects metadata class, and
+ * a block is pinned when it is read with BIO_PIN.
+ */
+void bio_prefetch (int dev, off_t from, off_t to, size_t count, int mode);
+
+/*
+ * Completion-driven reads: bio_read_async starts a read and returns at
+ * once, the completion is signalled by the descriptor returned from
+ * bio_async_fd, which becomes readable and may be polled by an event
+ * loop. The bio_async_poll runs callbacks of all completed reads in the
+ * calling thread and returns their number: a callback gets the block
+ * locked for reading, or NULL on failure, the block is released after
+ * callback returns, thus it must take its own reference to keep it.
+ */
+typedef void bio_async_fn (void *cookie, struct bio *o);
+
+bool bio_read_async (int dev, off_t offset, size_t count,
+		     bio_async_fn *fn, void *cookie);
+int bio_async_fd (void);
+size_t bio_async_poll (void);
+
+/*
+ * Wait until all released blocks are written back and freed
+ */
+void bio_drain (void);
+
+/*
+ * Wait for writes in flight to range of device, both of released blocks
+ * and of cached ones, used before direct reads that bypass the cache
+ */
+void bio_write_wait (int dev, off_t offset, size_t count);
+
+/*
+ * Delayed write-back: bio_write_defer finishes write transaction like
+ * bio_write_end (o, true) but only puts the block onto the dirty list of
+ * its device. The bio_sync_dev writes all dirty blocks of a device in
+ * offset order, merging adjacent blocks into vectored writes, and then
+ * flushes device. The bio_write_back writes dirty blocks the same way but
+ * does not flush device, it is cheap when nothing is deferred and makes
+ * delayed writes visible to direct reads that bypass the cache. Blocks
+ * failed to be written stay on the list for the next sync, until the
+ * bio_sync_release drops the list of device on close.
+ */
+bool bio_write_defer (struct bio *o);
+bool bio_write_back (int dev);
+bool bio_sync_dev (int dev);
+void bio_sync_release (int dev);
+
+/*
+ * Requests are started and joined under exclusive lock, readers wait for
+ * data to be loaded before they share the block
+ */
 static inline bool bio_read_begin (struct bio *o)
 {
-	rwlock_rdlock (&o->bio_lock);
+	bool ok;
 
-	if (bio_load (o))
-		return true;
+	for (;;) {
+		lockword_rdlock (&o->bio_lock);
 
-	rwlock_unlock (&o->bio_lock);
-	return false;
+		if ((o->bio_state & BIO_READY) != 0)
+			return true;
+
+		lockword_unlock (&o->bio_lock);
+
+		lockword_wrlock (&o->bio_lock);
+		ok = bio_load (o);
+		lockword_unlock (&o->bio_lock);
+
+		if (!ok)
+			return false;
+	}
 }
 
 static inline bool bio_write_begin (struct bio *o, bool modify)
 {
-	rwlock_wrlock (&o->bio_lock);
+	lockword_wrlock (&o->bio_lock);
+
+	if ((o->bio_state & BIO_BUSY) != 0 && !bio_join (o))
+		goto no_join;
 
 	if (!modify || bio_load (o))
 		return true;
-
-	rwlock_unlock (&o->bio_lock);
+no_join:
+	lockword_unlock (&o->bio_lock);
 	return false;
 }
 
 static inline bool bio_read_end (struct bio *o)
 {
-	rwlock_unlock (&o->bio_lock);
+	lockword_unlock (&o->bio_lock);
 	return true;
 }
 
@@ -120,7 +330,7 @@ static inline bool bio_write_end (struct bio *o, bool dirty)
 		ok = bio_save_emit (o);
 	}
 
-	rwlock_unlock (&o->bio_lock);
+	lockword_unlock (&o->bio_lock);
 	return ok;
 }
 
@@ -0,0 +1,137 @@
+/*
+ * Marten Bitmap Scan
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef MARTEN_BITMAP_H
+#define MARTEN_BITMAP_H  1
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined (__AVX2__) || defined (__SSE2__)
+#include <immintrin.h>
+#endif
+
+/*
+ * Bitmaps are byte arrays with bit i stored in bit (i % 8) of byte i / 8,
+ * as used by isset and friends. Scans load them by 64-bit words, thus on
+ * little-endian hosts a word is just a memory load, and skip blocks of
+ * empty (or full, for clear bit search) words with SIMD where available.
+ */
+static inline uint64_t bitmap_load (const uint8_t *map, size_t i, size_t size)
+{
+	const size_t pos = i * 64;
+	uint64_t w = 0;
+	size_t k;
+
+	if (pos + 64 <= size) {
+		memcpy (&w, map + i * 8, sizeof (w));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		w = __builtin_bswap64 (w);
+#endif
+		return w;
+	}
+
+	for (k = 0; pos + k * 8 < size; ++k)
+		w |= (uint64_t) map[i * 8 + k] << (k * 8);
+
+	return w & ((1ULL << (size - pos)) - 1);  /* drop bits past end */
+}
+
+/*
+ * Skip whole words equal to the fill pattern, returns index of the first
+ * word that differs or may be partial
+ */
+static inline
+size_t bitmap_skip (const uint8_t *map, size_t i, size_t size, uint64_t fill)
+{
+#if defined (__AVX2__)
+	const __m256i f = _mm256_set1_epi64x (fill);
+	__m256i v;
+
+	for (; (i + 4) * 64 <= size; i += 4) {
+		v = _mm256_loadu_si256 ((const void *) (map + i * 8));
+
+		if (_mm256_movemask_epi8 (_mm256_cmpeq_epi8 (v, f)) != -1)
+			break;
+	}
+#elif defined (__SSE2__)
+	const __m128i f = _mm_set1_epi64x (fill);
+	__m128i v;
+
+	for (; (i + 2) * 64 <= size; i += 2) {
+		v = _mm_loadu_si128 ((const void *) (map + i * 8));
+
+		if (_mm_movemask_epi8 (_mm_cmpeq_epi8 (v, f)) != 0xffff)
+			break;
+	}
+#endif
+	for (; (i + 1) * 64 <= size; ++i)
+		if (bitmap_load (map, i, size) != fill)
+			break;
+
+	return i;
+}
+
+static inline
+size_t bitmap_scan (const uint8_t *map, size_t from, size_t size, uint64_t flip)
+{
+	size_t i = from / 64, pos;
+	uint64_t w;
+
+	if (from >= size)
+		return size;
+
+	w = (bitmap_load (map, i, size) ^ flip) & (~0ULL << (from % 64));
+
+	while (w == 0) {
+		if (++i * 64 >= size)
+			return size;
+
+		i = bitmap_skip (map, i, size, flip);
+
+		if (i * 64 >= size)
+			return size;
+
+		w = bitmap_load (map, i, size) ^ flip;
+	}
+
+	pos = i * 64 + __builtin_ctzll (w);
+	return pos < size ? pos : size;
+}
+
+/*
+ * Return index of the first set (clear) bit at or after from, or size if
+ * there is no such bit
+ */
+static inline
+size_t bitmap_next_set (const uint8_t *map, size_t from, size_t size)
+{
+	return bitmap_scan (map, from, size, 0);
+}
+
+static inline
+size_t bitmap_next_clear (const uint8_t *map, size_t from, size_t size)
+{
+	return bitmap_scan (map, from, size, ~0ULL);
+}
+
+/*
+ * Return number of set bits in the first size bits of bitmap
+ */
+static inline size_t bitmap_count (const uint8_t *map, size_t size)
+{
+	size_t i, count = 0;
+
+	for (i = 0; i * 64 < size; ++i)
+		count += __builtin_popcountll (bitmap_load (map, i, size));
+
+	return count;
+}
+
+#endif  /* MARTEN_BITMAP_H */
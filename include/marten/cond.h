@@ -0,0 +1,34 @@
+/*
+ * Marten Condition Variable
+ *
+ * Copyright (c) 2019-2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef MARTEN_COND_H
+#define MARTEN_COND_H  1
+
+#ifdef __unix__
+#include <unistd.h>
+
+#ifdef _POSIX_THREADS
+#include <pthread.h>
+
+#define COND_INIT	PTHREAD_COND_INITIALIZER
+#define cond_t		pthread_cond_t
+#define cond_init(o)	pthread_cond_init ((o), NULL)
+#define cond_fini	pthread_cond_destroy
+#define cond_wait	pthread_cond_wait
+#define cond_timedwait	pthread_cond_timedwait	/* CLOCK_REALTIME */
+#define cond_signal	pthread_cond_signal
+#define cond_broadcast	pthread_cond_broadcast
+
+#endif  /* _POSIX_THREADS */
+#endif  /* __unix__ */
+
+#ifndef COND_INIT
+#error "Unsupported platform"
+#endif
+
+#endif  /* MARTEN_COND_H */
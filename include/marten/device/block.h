@@ -12,7 +12,107 @@
 #include <stddef.h>
 #include <sys/types.h>
 
+#include <marten/bool.h>
+
+#define DEV_WRITE	1	/* open device for writing		*/
+#define DEV_DIRECT	2	/* direct I/O, bypass system cache	*/
+#define DEV_MMAP	4	/* read-only zero-copy mapped image	*/
+
+/*
+ * Open device with given mode, returns device descriptor or -1 on error.
+ * For direct I/O devices all transfers must be aligned to the size
+ * returned by dev_block_align. The dev_block_get of mapped device returns
+ * pointer into the image, and dev_block_put of it does nothing.
+ */
+int    dev_block_open  (const char *path, int mode);
+void   dev_block_close (int dev);
+size_t dev_block_align (int dev);
+
+/*
+ * Size of device in bytes, or zero if unknown
+ */
+off_t dev_block_size (int dev);
+
+#define DEV_ADV_NORMAL		0
+#define DEV_ADV_RANDOM		1	/* random access expected	*/
+#define DEV_ADV_SEQ		2	/* sequential scan expected	*/
+#define DEV_ADV_WILLNEED	3	/* range will be accessed soon	*/
+
+/*
+ * Hint expected access pattern for range of device, zero count means up
+ * to the end of device
+ */
+void dev_block_advise (int dev, off_t offset, size_t count, int advice);
+
+/*
+ * Set cache unit: requests that fit into one aligned unit of given size
+ * order are served by the cache as slices of the whole unit. The
+ * dev_block_round extends a request to the range cached for it.
+ */
+bool dev_block_set_unit (int dev, unsigned order);
+void dev_block_round (int dev, off_t *offset, size_t *count);
+
+/*
+ * Device backend interface: the cookie is passed to every operation. The
+ * dev_block_attach registers backend and returns negative device handle
+ * or -1 on error, dev_block_close of the handle calls the close operation.
+ * Descriptor devices use asynchronous I/O engine (POSIX AIO or io_uring)
+ * for block transfers, attached backends are called synchronously.
+ */
+struct iovec;
+
+struct dev_ops {
+	ssize_t (*read)   (void *cookie, void *buf, size_t count, off_t pos);
+	ssize_t (*write)  (void *cookie, const void *buf, size_t count,
+			   off_t pos);
+	ssize_t (*readv)  (void *cookie, const struct iovec *iov, int n,
+			   off_t pos);
+	ssize_t (*writev) (void *cookie, const struct iovec *iov, int n,
+			   off_t pos);
+	int     (*flush)  (void *cookie);
+	void  (*prefetch) (void *cookie, off_t pos, size_t count);
+	void    (*close)  (void *cookie);
+};
+
+int dev_block_attach (const struct dev_ops *ops, void *cookie, off_t size);
+
+static inline bool dev_block_async (int dev)
+{
+	return dev >= 0;
+}
+
+ssize_t dev_block_read   (int dev, void *buf, size_t count, off_t offset);
+ssize_t dev_block_write  (int dev, const void *buf, size_t count,
+			  off_t offset);
+ssize_t dev_block_readv  (int dev, const struct iovec *iov, int n,
+			  off_t offset);
+ssize_t dev_block_writev (int dev, const struct iovec *iov, int n,
+			  off_t offset);
+int     dev_block_flush  (int dev);
+
+/*
+ * RAM disk of given size, initially zero-filled
+ */
+int dev_block_ram (size_t size);
+
+/*
+ * Get block of device: with DEV_PULL data is read through the cache,
+ * otherwise private uninitialized buffer is returned. DEV_META and DEV_PIN
+ * select cache class for metadata blocks.
+ */
+#define DEV_PULL	1
+#define DEV_META	2	/* metadata, keep cached in priority	*/
+#define DEV_PIN		4	/* pin metadata block in cache		*/
+
 void *dev_block_get (int dev, off_t offset, size_t count, int pull);
 void  dev_block_put (void *o, size_t count);
 
+/*
+ * Get n consecutive blocks of given size starting at offset into v, the
+ * reads of blocks missing in cache are submitted with one batch. Either
+ * all blocks are returned or none.
+ */
+bool dev_block_get_many (int dev, off_t offset, size_t count, size_t n,
+			 int pull, void *v[]);
+
 #endif  /* MARTEN_DEVICE_BLOCK_H */
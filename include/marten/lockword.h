@@ -0,0 +1,117 @@
+/*
+ * Marten Compact Reader-Writer Lock
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef MARTEN_LOCKWORD_H
+#define MARTEN_LOCKWORD_H  1
+
+#include <marten/atomic.h>
+
+#ifdef __linux__
+#include <limits.h>
+#include <unistd.h>
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#else
+#include <sched.h>
+#endif
+
+/*
+ * Reader-writer lock in one word: the high bit is set while a writer
+ * holds the lock, the next one while somebody sleeps waiting for it, the
+ * rest counts readers. Sleepers are woken all at once on release and
+ * compete again, thus lock prefers no one.
+ */
+#define LOCKWORD_INIT	0
+#define LOCKWORD_W	(1U << 31)
+#define LOCKWORD_WAIT	(1U << 30)
+
+typedef atomic_uint lockword_t;
+
+#define lockword_init(o)	atomic_init ((o), LOCKWORD_INIT)
+
+static inline void lockword_sleep (lockword_t *o, unsigned v)
+{
+	if ((v & LOCKWORD_WAIT) == 0 &&
+	    !atomic_compare_exchange_weak_explicit (o, &v, v | LOCKWORD_WAIT,
+						    memory_order_relaxed,
+						    memory_order_relaxed))
+		return;
+#ifdef __linux__
+	syscall (SYS_futex, o, FUTEX_WAIT_PRIVATE, v | LOCKWORD_WAIT,
+		 NULL, NULL, 0);
+#else
+	sched_yield ();
+#endif
+}
+
+static inline void lockword_wake (lockword_t *o)
+{
+#ifdef __linux__
+	syscall (SYS_futex, o, FUTEX_WAKE_PRIVATE, INT_MAX, NULL, NULL, 0);
+#endif
+}
+
+static inline void lockword_rdlock (lockword_t *o)
+{
+	unsigned v = atomic_load_explicit (o, memory_order_relaxed);
+
+	for (;;)
+		if ((v & LOCKWORD_W) != 0) {
+			lockword_sleep (o, v);
+			v = atomic_load_explicit (o, memory_order_relaxed);
+		}
+		else if (atomic_compare_exchange_weak_explicit (o, &v, v + 1,
+							       memory_order_acquire,
+							       memory_order_relaxed))
+			return;
+}
+
+static inline void lockword_wrlock (lockword_t *o)
+{
+	unsigned v = atomic_load_explicit (o, memory_order_relaxed);
+
+	for (;;)
+		if ((v & ~LOCKWORD_WAIT) != 0) {
+			lockword_sleep (o, v);
+			v = atomic_load_explicit (o, memory_order_relaxed);
+		}
+		else if (atomic_compare_exchange_weak_explicit (o, &v,
+							       v | LOCKWORD_W,
+							       memory_order_acquire,
+							       memory_order_relaxed))
+			return;
+}
+
+static inline bool lockword_trywrlock (lockword_t *o)
+{
+	unsigned v = 0;
+
+	return atomic_compare_exchange_strong_explicit (o, &v, LOCKWORD_W,
+							memory_order_acquire,
+							memory_order_relaxed);
+}
+
+static inline void lockword_unlock (lockword_t *o)
+{
+	unsigned v = atomic_load_explicit (o, memory_order_relaxed);
+
+	if ((v & LOCKWORD_W) != 0)
+		v = atomic_exchange_explicit (o, 0, memory_order_release);
+	else if ((v = atomic_fetch_sub_explicit (o, 1, memory_order_release)
+		  - 1) != LOCKWORD_WAIT ||
+		 !atomic_compare_exchange_strong_explicit (o, &v, 0,
+							   memory_order_relaxed,
+							   memory_order_relaxed))
+		return;
+
+	if ((v & LOCKWORD_WAIT) != 0)
+		lockword_wake (o);
+}
+
+#endif  /* MARTEN_LOCKWORD_H */
@@ -18,6 +18,7 @@
 #define MUTEX_INIT	PTHREAD_MUTEX_INITIALIZER
 #define mutex_t		pthread_mutex_t
 #define mutex_init(o)	pthread_mutex_init ((o), NULL)
+#define mutex_fini	pthread_mutex_destroy
 #define mutex_lock	pthread_mutex_lock
 #define mutex_unlock	pthread_mutex_unlock
 
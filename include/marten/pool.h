@@ -0,0 +1,30 @@
+/*
+ * Marten Buffer Pool
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef MARTEN_POOL_H
+#define MARTEN_POOL_H  1
+
+#include <stddef.h>
+
+#include <marten/bool.h>
+
+/*
+ * Block buffers are allocated from power-of-two size classes, every
+ * buffer is aligned to its class size (thus buffers of page size and
+ * larger are page-aligned and suitable for direct I/O). The size passed
+ * to pool_free must be equal to the size passed to pool_alloc.
+ */
+void *pool_alloc (size_t size);
+void  pool_free  (void *o, size_t size);
+
+/*
+ * Back new pool memory with huge pages where supported
+ */
+void pool_huge (bool enable);
+
+#endif  /* MARTEN_POOL_H */
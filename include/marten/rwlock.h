@@ -20,6 +20,7 @@
 #define rwlock_init(o)	pthread_rwlock_init (o, NULL)
 #define rwlock_rdlock	pthread_rwlock_rdlock
 #define rwlock_wrlock	pthread_rwlock_wrlock
+#define rwlock_trywrlock(o)	(pthread_rwlock_trywrlock (o) == 0)
 #define rwlock_unlock	pthread_rwlock_unlock
 
 #endif  /* _POSIX_THREADS */
@@ -0,0 +1,30 @@
+/*
+ * Marten Thread
+ *
+ * Copyright (c) 2019-2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#ifndef MARTEN_THREAD_H
+#define MARTEN_THREAD_H  1
+
+#ifdef __unix__
+#include <unistd.h>
+
+#ifdef _POSIX_THREADS
+#include <pthread.h>
+
+#define thread_t		pthread_t
+#define thread_create(o, fn, arg)	(pthread_create ((o), NULL, (fn), (arg)) == 0)
+#define thread_join(o, ret)	(pthread_join ((o), (ret)) == 0)
+#define thread_detach(o)	(pthread_detach (o) == 0)
+
+#endif  /* _POSIX_THREADS */
+#endif  /* __unix__ */
+
+#ifndef thread_t
+#error "Unsupported platform"
+#endif
+
+#endif  /* MARTEN_THREAD_H */
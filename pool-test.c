@@ -0,0 +1,209 @@
+/*
+ * Marten Buffer Pool Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include <marten/pool.h>
+
+#define MIN_ORDER	7	/* smallest class, 128 bytes	*/
+#define MAX_ORDER	16	/* largest class, 64 KiB	*/
+
+#define THREADS		8
+#define SLOTS		64
+#define ROUNDS		20000
+
+static int aligned (const void *o, size_t align)
+{
+	return ((uintptr_t) o & (align - 1)) == 0;
+}
+
+/*
+ * Allocate two buffers of the size, check that both are aligned to the
+ * class size, do not overlap and the whole class size is usable
+ */
+static int check_size (size_t size, unsigned order)
+{
+	const size_t len = 1UL << order;
+	char *a, *b;
+	int ok = 0;
+
+	a = pool_alloc (size);
+	b = pool_alloc (size);
+
+	if (a == NULL || b == NULL) {
+		fprintf (stderr, "E: cannot allocate %zu bytes\n", size);
+		goto out;
+	}
+
+	if (!aligned (a, len) || !aligned (b, len)) {
+		fprintf (stderr, "E: %zu byte buffer is not aligned to %zu\n",
+			 size, len);
+		goto out;
+	}
+
+	memset (a, 0xa5, len);
+	memset (b, 0x5a, len);
+
+	if (a[0] != (char) 0xa5 || a[len - 1] != (char) 0xa5) {
+		fprintf (stderr, "E: %zu byte buffers overlap\n", size);
+		goto out;
+	}
+
+	ok = 1;
+out:
+	pool_free (b, size);
+	pool_free (a, size);
+	return ok;
+}
+
+/*
+ * Check sizes at and just past every class boundary
+ */
+static int check_classes (void)
+{
+	unsigned order;
+
+	if (!check_size (1, MIN_ORDER))
+		return 0;
+
+	for (order = MIN_ORDER; order <= MAX_ORDER; ++order)
+		if (!check_size (1UL << order, order) ||
+		    (order < MAX_ORDER &&
+		     !check_size ((1UL << order) + 1, order + 1)))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Buffers larger than the largest class are mapped directly, thus page
+ * aligned
+ */
+static int check_large (void)
+{
+	const size_t page = sysconf (_SC_PAGESIZE);
+	const size_t v[] = {
+		(1UL << MAX_ORDER) + 1, (1UL << MAX_ORDER) * 3, 1UL << 22,
+	};
+	size_t i;
+	char *o;
+
+	for (i = 0; i < sizeof (v) / sizeof (v[0]); ++i) {
+		if ((o = pool_alloc (v[i])) == NULL) {
+			fprintf (stderr, "E: cannot allocate %zu bytes\n", v[i]);
+			return 0;
+		}
+
+		if (!aligned (o, page)) {
+			fprintf (stderr, "E: %zu byte buffer is not page "
+					 "aligned\n", v[i]);
+			pool_free (o, v[i]);
+			return 0;
+		}
+
+		memset (o, 0xa5, v[i]);
+		pool_free (o, v[i]);
+	}
+
+	return 1;
+}
+
+struct slot {
+	char	*o;
+	size_t	size;
+};
+
+static int slot_valid (const struct slot *s, int tag)
+{
+	size_t i;
+
+	for (i = 0; i < s->size; ++i)
+		if (s->o[i] != (char) tag)
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Every thread fills its buffers with its own tag and checks it before
+ * release: a buffer handed out twice gets a foreign tag
+ */
+static void *worker (void *cookie)
+{
+	const int tag = (uintptr_t) cookie;
+	unsigned seed = tag;
+	struct slot v[SLOTS] = {};
+	struct slot *s;
+	unsigned order;
+	size_t i;
+	void *ret = NULL;
+
+	for (i = 0; i < ROUNDS; ++i) {
+		s = v + rand_r (&seed) % SLOTS;
+
+		if (s->o != NULL) {
+			if (!slot_valid (s, tag)) {
+				ret = cookie;
+				break;
+			}
+
+			pool_free (s->o, s->size);
+		}
+
+		order = MIN_ORDER + rand_r (&seed) % (MAX_ORDER - MIN_ORDER + 1);
+		s->size = 1 + rand_r (&seed) % (1UL << order);
+
+		if ((s->o = pool_alloc (s->size)) == NULL) {
+			ret = cookie;
+			break;
+		}
+
+		memset (s->o, tag, s->size);
+	}
+
+	for (i = 0; i < SLOTS; ++i)
+		pool_free (v[i].o, v[i].size);
+
+	return ret;
+}
+
+static int check_threads (void)
+{
+	pthread_t tid[THREADS];
+	size_t i, n;
+	void *ret;
+	int ok = 1;
+
+	for (i = 0; i < THREADS; ++i)
+		if (pthread_create (tid + i, NULL, worker,
+				    (void *) (i + 1)) != 0)
+			break;
+
+	for (n = i, i = 0; i < n; ++i) {
+		pthread_join (tid[i], &ret);
+		ok &= ret == NULL;
+	}
+
+	if (n < THREADS || !ok) {
+		fprintf (stderr, "E: concurrent allocation failed\n");
+		return 0;
+	}
+
+	return 1;
+}
+
+int main (int argc, char *argv[])
+{
+	return check_classes () && check_large () && check_threads () ? 0 : 1;
+}
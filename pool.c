@@ -0,0 +1,157 @@
+/*
+ * Marten Buffer Pool
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdint.h>
+
+#include <sys/mman.h>
+
+#include <marten/atomic.h>
+#include <marten/mutex.h>
+#include <marten/pool.h>
+
+#define POOL_MIN_ORDER		7	/* smallest class, 128 bytes	*/
+#define POOL_MAX_ORDER		16	/* largest class, 64 KiB	*/
+#define POOL_ARENA_ORDER	21	/* arena size, 2 MiB		*/
+
+#define POOL_CLASSES	(POOL_MAX_ORDER - POOL_MIN_ORDER + 1)
+#define POOL_SLAB	(1UL << POOL_MAX_ORDER)
+#define POOL_ARENA	(1UL << POOL_ARENA_ORDER)
+
+/*
+ * Every size class has its own free list and takes memory by slabs of
+ * the largest class size from the shared arena, arenas are aligned to
+ * their size to be eligible for huge pages. Pool memory is never returned
+ * to the system but reused by buffers of the same class.
+ */
+struct pool_class {
+	mutex_t		lock;
+	void		*free;		/* free list head		*/
+	char		*next, *end;	/* unused part of current slab	*/
+};
+
+static struct pool_class pool[POOL_CLASSES] = {
+	[0 ... POOL_CLASSES - 1] = { .lock = MUTEX_INIT },
+};
+
+static mutex_t arena_lock = MUTEX_INIT;
+static char *arena_next, *arena_end;
+static atomic_int arena_huge;
+
+static void *pool_map (size_t size)
+{
+	void *p = mmap (NULL, size, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	return p == MAP_FAILED ? NULL : p;
+}
+
+/*
+ * Map twice the arena size and trim it down to the aligned arena
+ */
+static bool pool_arena_grow (void)
+{
+	char *p, *start;
+
+	if ((p = pool_map (POOL_ARENA * 2)) == NULL)
+		return false;
+
+	start = (char *) (((uintptr_t) p + POOL_ARENA - 1) & ~(POOL_ARENA - 1));
+
+	if (start > p)
+		munmap (p, start - p);
+
+	munmap (start + POOL_ARENA, p + POOL_ARENA - start);
+
+#ifdef MADV_HUGEPAGE
+	if (atomic_load_explicit (&arena_huge, memory_order_relaxed))
+		madvise (start, POOL_ARENA, MADV_HUGEPAGE);
+#endif
+	arena_next = start;
+	arena_end  = start + POOL_ARENA;
+	return true;
+}
+
+static void *pool_slab (void)
+{
+	void *p = NULL;
+
+	mutex_lock (&arena_lock);
+
+	if (arena_next < arena_end || pool_arena_grow ()) {
+		p = arena_next;
+		arena_next += POOL_SLAB;
+	}
+
+	mutex_unlock (&arena_lock);
+	return p;
+}
+
+static unsigned pool_order (size_t size)
+{
+	unsigned order = POOL_MIN_ORDER;
+
+	while ((1UL << order) < size)
+		++order;
+
+	return order;
+}
+
+void *pool_alloc (size_t size)
+{
+	const unsigned order = pool_order (size);
+	struct pool_class *c;
+	void *o;
+
+	if (order > POOL_MAX_ORDER)
+		return pool_map (size);
+
+	c = pool + (order - POOL_MIN_ORDER);
+	mutex_lock (&c->lock);
+
+	if ((o = c->free) != NULL)
+		c->free = *(void **) o;
+	else {
+		if (c->next == c->end && (o = pool_slab ()) != NULL) {
+			c->next = o;
+			c->end  = c->next + POOL_SLAB;
+		}
+
+		if ((o = c->next) != c->end)
+			c->next += 1UL << order;
+		else
+			o = NULL;
+	}
+
+	mutex_unlock (&c->lock);
+	return o;
+}
+
+void pool_free (void *o, size_t size)
+{
+	const unsigned order = pool_order (size);
+	struct pool_class *c;
+
+	if (o == NULL)
+		return;
+
+	if (order > POOL_MAX_ORDER) {
+		munmap (o, size);
+		return;
+	}
+
+	c = pool + (order - POOL_MIN_ORDER);
+	mutex_lock (&c->lock);
+	*(void **) o = c->free;
+	c->free = o;
+	mutex_unlock (&c->lock);
+}
+
+void pool_huge (bool enable)
+{
+	atomic_store_explicit (&arena_huge, enable, memory_order_relaxed);
+}
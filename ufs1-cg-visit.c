@@ -0,0 +1,171 @@
+/*
+ * UFS1 Parallel Cylinder Group Visitor
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <stdlib.h>
+
+#include <fs/ufs1-cg.h>
+#include <marten/cond.h>
+#include <marten/mutex.h>
+#include <marten/thread.h>
+
+#define UFS1_VISIT_THREADS	64	/* max number of workers	*/
+#define UFS1_VISIT_AHEAD	4	/* groups in work per worker	*/
+
+/*
+ * Workers take groups in order, but do not run further than the window of
+ * groups ahead of the first one not delivered yet, thus results waiting
+ * for delivery are bounded regardless of the number of groups
+ */
+struct ufs1_visit {
+	struct ufs1_sb		*sb;
+	ufs1_cg_visit_fn	*visit;
+	void			*cookie;
+
+	mutex_t			lock;
+	cond_t			cond;
+	uint32_t		next;		/* group to take	*/
+	uint32_t		head;		/* group to deliver	*/
+	uint32_t		window;
+	void			**result;
+	unsigned char		*ready;
+};
+
+static void *ufs1_visit_one (struct ufs1_visit *o, uint32_t cgx)
+{
+	struct ufs1_cg c;
+	void *result;
+
+	if (!ufs1_cg_init (&c, o->sb, cgx))
+		return o->visit (o->cookie, cgx, NULL);
+
+	result = o->visit (o->cookie, cgx, &c);
+	ufs1_cg_fini (&c);
+	return result;
+}
+
+static void *ufs1_visit_worker (void *cookie)
+{
+	struct ufs1_visit *o = cookie;
+	uint32_t cgx;
+	void *result;
+
+	mutex_lock (&o->lock);
+
+	for (;;) {
+		while (o->next < o->sb->ncg && o->next - o->head >= o->window)
+			cond_wait (&o->cond, &o->lock);
+
+		if ((cgx = o->next) >= o->sb->ncg)
+			break;
+
+		++o->next;
+		mutex_unlock (&o->lock);
+
+		result = ufs1_visit_one (o, cgx);
+
+		mutex_lock (&o->lock);
+
+		o->result[cgx % o->window] = result;
+		o->ready [cgx % o->window] = 1;
+		cond_broadcast (&o->cond);
+	}
+
+	mutex_unlock (&o->lock);
+	return NULL;
+}
+
+static unsigned ufs1_visit_threads (const struct ufs1_sb *sb, unsigned count)
+{
+	long n;
+
+	if (count == 0)
+		count = (n = sysconf (_SC_NPROCESSORS_ONLN)) > 0 ? n : 1;
+
+	if (count > UFS1_VISIT_THREADS)
+		count = UFS1_VISIT_THREADS;
+
+	return count < sb->ncg ? count : sb->ncg;
+}
+
+static void ufs1_visit_serial (struct ufs1_visit *o, ufs1_cg_done_fn *done)
+{
+	uint32_t cgx;
+
+	for (cgx = 0; cgx < o->sb->ncg; ++cgx)
+		done (o->cookie, cgx, ufs1_visit_one (o, cgx));
+}
+
+int ufs1_cg_visit (struct ufs1_sb *sb, unsigned threads,
+		   ufs1_cg_visit_fn *visit, ufs1_cg_done_fn *done,
+		   void *cookie)
+{
+	const unsigned count = ufs1_visit_threads (sb, threads);
+	const size_t size = count * UFS1_VISIT_AHEAD;
+	struct ufs1_visit o = { sb, visit, cookie };
+	thread_t t[UFS1_VISIT_THREADS];
+	unsigned i, n;
+	uint32_t cgx;
+	void *result;
+	int ok = 0;
+
+	if (count < 2) {
+		ufs1_visit_serial (&o, done);
+		return 1;
+	}
+
+	if ((o.result = calloc (size, sizeof (o.result[0]))) == NULL)
+		return 0;
+
+	if ((o.ready = calloc (size, sizeof (o.ready[0]))) == NULL)
+		goto no_ready;
+
+	mutex_init (&o.lock);
+	cond_init (&o.cond);
+
+	/* workers wait for the window sized to the number of started ones */
+	mutex_lock (&o.lock);
+
+	for (n = 0; n < count && thread_create (t + n, ufs1_visit_worker, &o);
+	     ++n) {}
+
+	o.window = n * UFS1_VISIT_AHEAD;
+	mutex_unlock (&o.lock);
+
+	if (n == 0) {
+		ufs1_visit_serial (&o, done);
+		goto no_workers;
+	}
+
+	/* deliver results in order of groups as they become ready */
+	for (cgx = 0; cgx < sb->ncg; ++cgx) {
+		mutex_lock (&o.lock);
+
+		while (!o.ready[cgx % o.window])
+			cond_wait (&o.cond, &o.lock);
+
+		result = o.result[cgx % o.window];
+		o.ready[cgx % o.window] = 0;
+		++o.head;
+
+		cond_broadcast (&o.cond);
+		mutex_unlock (&o.lock);
+
+		done (cookie, cgx, result);
+	}
+
+	for (i = 0; i < n; ++i)
+		(void) thread_join (t[i], NULL);
+no_workers:
+	cond_fini (&o.cond);
+	mutex_fini (&o.lock);
+	free (o.ready);
+	ok = 1;
+no_ready:
+	free (o.result);
+	return ok;
+}
@@ -26,9 +26,10 @@ static inline int ufs1_cg_error (struct ufs1_cg *o, const char *reason)
 int ufs1_cg_init (struct ufs1_cg *o, struct ufs1_sb *s, uint32_t cgx)
 {
 	const off_t pos = (off_t) ufs1_cg_cblkno (o->sb = s, cgx) << s->fshift;
+	const int mode  = DEV_PULL | DEV_META | DEV_PIN;
 	struct ufs1_cg_v2 *c;
 
-	if ((c = o->data = dev_block_get (s->dev, pos, s->cgsize, 1)) == NULL)
+	if ((c = o->data = dev_block_get (s->dev, pos, s->cgsize, mode)) == NULL)
 		return 0;
 
 	if (c->cg_magic != UFS1_CG_MAGIC)
@@ -0,0 +1,135 @@
+/*
+ * UFS1 File Read
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <fs/ufs1-dirent-v2.h>
+#include <marten/bio.h>
+
+#include "ufs1-inode.h"
+
+#define UFS1_FILE_EXTENTS	16	/* extents mapped per pass	*/
+
+/*
+ * Copy device range through cache block by block, used for the parts of
+ * request that do not meet direct I/O alignment
+ */
+static int ufs1_file_copy (const struct ufs1_sb *sb, off_t pos, char *buf,
+			   size_t count, int pull)
+{
+	const off_t mask = ((off_t) 1 << sb->bshift) - 1;
+	size_t len;
+	void *p;
+
+	for (; count > 0; pos += len, buf += len, count -= len) {
+		len = MIN (count, (size_t) (mask + 1 - (pos & mask)));
+
+		if ((p = dev_block_get (sb->dev, pos, len, pull)) == NULL)
+			return 0;
+
+		memcpy (buf, p, len);
+		dev_block_put (p, len);
+	}
+
+	return 1;
+}
+
+/*
+ * Read contiguous device range straight into the caller buffer after
+ * writes in flight to it are finished, an unaligned tail is copied
+ * through cache
+ */
+static int ufs1_file_fetch (const struct ufs1_sb *sb, off_t pos, char *buf,
+			    size_t count, int pull)
+{
+	const size_t mask = dev_block_align (sb->dev) - 1;
+	size_t tail = count & mask;
+	ssize_t len;
+
+	if (((pos | (uintptr_t) buf) & mask) != 0)
+		tail = count;  /* no aligned part */
+
+	if ((count -= tail) > 0)
+		bio_write_wait (sb->dev, pos, count);
+
+	for (; count > 0; pos += len, buf += len, count -= len)
+		if ((len = dev_block_read (sb->dev, buf, count, pos)) <= 0) {
+			if (len == 0)
+				errno = EIO;
+
+			return 0;
+		}
+
+	return tail == 0 || ufs1_file_copy (sb, pos, buf, tail, pull);
+}
+
+static int ufs1_file_extent (const struct ufs1_sb *sb,
+			     const struct ufs1_extent *e, off_t from, off_t to,
+			     char *buf, int pull)
+{
+	const off_t head = MAX (from, (off_t) e->block << sb->bshift);
+	const off_t tail = MIN (to, (off_t) (e->block + e->count) << sb->bshift);
+	const off_t pos  = ((off_t) e->frag << sb->fshift) +
+			   (head - ((off_t) e->block << sb->bshift));
+
+	if (e->frag == 0) {
+		memset (buf + (head - from), 0, tail - head);
+		return 1;
+	}
+
+	return ufs1_file_fetch (sb, pos, buf + (head - from), tail - head,
+				pull);
+}
+
+ssize_t ufs1_file_read (const struct ufs1_sb *sb, const struct ufs1_inode *o,
+			off_t offset, void *buf, size_t count)
+{
+	const int type = IFTODT (o->i_mode);
+	const int pull = type == DT_DIR ? DEV_PULL | DEV_META : DEV_PULL;
+	struct ufs1_extent v[UFS1_FILE_EXTENTS];
+	uint64_t block, last;
+	off_t end;
+	ssize_t n, i;
+
+	if (offset < 0 || offset >= o->i_size)
+		return 0;
+
+	count = MIN (count, o->i_size - offset);
+	end   = offset + count;
+
+	if (type == DT_LNK && o->i_size < sizeof (o->i_content)) {
+		memcpy (buf, o->i_content + offset, count);
+		return count;
+	}
+
+	/* direct reads bypass the cache, write delayed blocks back first */
+	if (!bio_write_back (sb->dev))
+		return -1;
+
+	block = offset >> sb->bshift;
+	last  = (end - 1) >> sb->bshift;
+
+	while (block <= last) {
+		n = ufs1_inode_map_range (sb, o, block, last - block + 1, v,
+					  ARRAY_SIZE (v));
+		if (n <= 0)
+			return -1;
+
+		for (i = 0; i < n; ++i)
+			if (!ufs1_file_extent (sb, v + i, offset, end, buf, pull))
+				return -1;
+
+		block = v[n - 1].block + v[n - 1].count;
+	}
+
+	return count;
+}
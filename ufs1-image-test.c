@@ -0,0 +1,793 @@
+/*
+ * UNIX File System v1 Generated Image Test
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <unistd.h>
+
+#include <fs/ufs1-cg-v2.h>
+#include <fs/ufs1-dirent-v2.h>
+#include <fs/ufs1-sb-v2.h>
+#include <marten/bio-cache.h>
+#include <marten/device/block.h>
+
+#include "ufs1-inode.h"
+
+/*
+ * Image layout: four groups of 2 MiB with 4 KiB blocks of 512-byte
+ * fragments, the super block is at 8 KiB as usual
+ */
+#define IMG_BSHIFT	12
+#define IMG_FSHIFT	9
+#define IMG_BSIZE	(1 << IMG_BSHIFT)
+#define IMG_FSIZE	(1 << IMG_FSHIFT)
+#define IMG_FRAG	(IMG_BSIZE / IMG_FSIZE)
+#define IMG_NINDIR	(IMG_BSIZE / 4)
+
+#define IMG_NCG		4
+#define IMG_FPG		4096
+#define IMG_IPG		256
+#define IMG_SBLKNO	16
+#define IMG_CBLKNO	24
+#define IMG_IBLKNO	32
+#define IMG_DBLKNO	(IMG_IBLKNO + IMG_IPG * 128 / IMG_FSIZE)
+#define IMG_SIZE	((size_t) IMG_NCG * IMG_FPG * IMG_FSIZE)
+
+/*
+ * Files: a small one, a big one reaching double indirect blocks with
+ * holes in single and double indirect ranges, a short symbolic link, and
+ * a small file in the second group
+ */
+#define INO_SMALL	3
+#define INO_BIG		4
+#define INO_LINK	5
+#define INO_OTHER	(IMG_IPG + 1)
+
+#define SMALL_SIZE	5000
+#define BIG_SIZE	(1100ULL * IMG_BSIZE - 1000)
+#define OTHER_SIZE	(3 * IMG_BSIZE)
+#define LINK_TARGET	"small"
+
+static const char *img_path = "ufs1-image-test.img";
+static const char *bad_path = "ufs1-image-test-bad.img";
+
+struct image {
+	uint8_t		*data;
+	uint32_t	cgx;			/* group to allocate from */
+	uint32_t	next[IMG_NCG];		/* first free fragment	  */
+	uint8_t		used[IMG_NCG * IMG_IPG];
+};
+
+static int img_hole (uint32_t ino, uint64_t i)
+{
+	return ino == INO_BIG &&
+	       ((i >= 20 && i < 40) || (i >= 1040 && i < 1050));
+}
+
+static uint8_t img_byte (uint32_t ino, uint64_t pos)
+{
+	return pos ^ (pos >> IMG_BSHIFT) * 7 ^ ino;
+}
+
+static void *img_frag (struct image *o, int32_t frag)
+{
+	return o->data + ((size_t) frag << IMG_FSHIFT);
+}
+
+static struct ufs1_inode *img_inode (struct image *o, uint32_t ino)
+{
+	const size_t base = (size_t) (ino / IMG_IPG) * IMG_FPG + IMG_IBLKNO;
+
+	return (struct ufs1_inode *) img_frag (o, base) + ino % IMG_IPG;
+}
+
+static int32_t img_alloc (struct image *o)
+{
+	int32_t frag;
+
+	for (; o->cgx < IMG_NCG; ++o->cgx)
+		if (o->next[o->cgx] + IMG_FRAG <= (o->cgx + 1) * IMG_FPG) {
+			frag = o->next[o->cgx];
+			o->next[o->cgx] += IMG_FRAG;
+			return frag;
+		}
+
+	fprintf (stderr, "E: image is full\n");
+	exit (1);
+}
+
+static int32_t *img_slot (struct image *o, int32_t *ind, uint64_t i)
+{
+	if (*ind == 0)
+		*ind = img_alloc (o);  /* image is zero-filled */
+
+	return (int32_t *) img_frag (o, *ind) + i;
+}
+
+static void img_map (struct image *o, struct ufs1_inode *in, uint64_t i,
+		     int32_t frag)
+{
+	if (i < 12) {
+		in->i_db[i] = frag;
+		return;
+	}
+
+	if ((i -= 12) < IMG_NINDIR) {
+		*img_slot (o, &in->i_ib[0], i) = frag;
+		return;
+	}
+
+	i -= IMG_NINDIR;
+	*img_slot (o, img_slot (o, &in->i_ib[1], i / IMG_NINDIR),
+		   i % IMG_NINDIR) = frag;
+}
+
+static void img_file (struct image *o, uint32_t ino, uint64_t size)
+{
+	struct ufs1_inode *in = img_inode (o, ino);
+	uint64_t i, j, pos;
+	int32_t frag;
+	uint8_t *p;
+
+	o->used[ino] = 1;
+	o->cgx = ino / IMG_IPG;
+
+	in->i_mode  = 0100644;
+	in->i_nlink = 1;
+	in->i_size  = size;
+
+	for (i = 0; i << IMG_BSHIFT < size; ++i) {
+		if (img_hole (ino, i))
+			continue;
+
+		frag = img_alloc (o);
+		img_map (o, in, i, frag);
+
+		for (p = img_frag (o, frag), j = 0; j < IMG_BSIZE; ++j) {
+			pos = (i << IMG_BSHIFT) + j;
+			p[j] = pos < size ? img_byte (ino, pos) : 0;
+		}
+
+		in->i_blocks += IMG_BSIZE / 512;
+	}
+}
+
+static void img_link (struct image *o, uint32_t ino, const char *target)
+{
+	struct ufs1_inode *in = img_inode (o, ino);
+
+	o->used[ino] = 1;
+
+	in->i_mode  = 0120777;
+	in->i_nlink = 1;
+	in->i_size  = strlen (target);
+	memcpy (in->i_content, target, in->i_size);
+}
+
+static void img_group (struct image *o, uint32_t cgx, struct ufs1_cs *total)
+{
+	const size_t start = (size_t) cgx * IMG_FPG;
+	struct ufs1_cg_v2 *c = img_frag (o, start + IMG_CBLKNO);
+	uint8_t *imap, *fmap;
+	uint32_t i;
+
+	c->cg_magic	  = UFS1_CG_MAGIC;
+	c->cg_cgx	  = cgx;
+	c->cg_ipg	  = IMG_IPG;
+	c->cg_fpg	  = IMG_FPG;
+	c->cg_iusedoff	  = sizeof (*c);
+	c->cg_freeoff	  = c->cg_iusedoff + IMG_IPG / 8;
+	c->cg_nextfreeoff = c->cg_freeoff + IMG_FPG / 8;
+
+	imap = (uint8_t *) c + c->cg_iusedoff;
+	fmap = (uint8_t *) c + c->cg_freeoff;
+
+	for (i = 0; i < IMG_IPG; ++i)
+		if (o->used[cgx * IMG_IPG + i])
+			imap[i / 8] |= 1 << (i % 8);
+		else
+			++c->cg_cs.cs_nifree;
+
+	for (i = o->next[cgx] - start; i < IMG_FPG; ++i)
+		fmap[i / 8] |= 1 << (i % 8);
+
+	c->cg_cs.cs_nbfree = (IMG_FPG - (o->next[cgx] - start)) / IMG_FRAG;
+
+	total->cs_nifree += c->cg_cs.cs_nifree;
+	total->cs_nbfree += c->cg_cs.cs_nbfree;
+}
+
+static void img_super (struct image *o)
+{
+	struct ufs1_sb_v2 *s = (void *) (o->data + 8192);
+	uint32_t cgx;
+
+	s->s_sblkno	 = IMG_SBLKNO;
+	s->s_cblkno	 = IMG_CBLKNO;
+	s->s_iblkno	 = IMG_IBLKNO;
+	s->s_dblkno	 = IMG_DBLKNO;
+	s->s_cgmask	 = -1;
+	s->s_size	 = IMG_NCG * IMG_FPG;
+	s->s_ncg	 = IMG_NCG;
+	s->s_bsize	 = IMG_BSIZE;
+	s->s_fsize	 = IMG_FSIZE;
+	s->s_frag	 = IMG_FRAG;
+	s->s_bmask	 = ~0L << IMG_BSHIFT;
+	s->s_fmask	 = ~0L << IMG_FSHIFT;
+	s->s_bshift	 = IMG_BSHIFT;
+	s->s_fshift	 = IMG_FSHIFT;
+	s->s_fragshift	 = IMG_BSHIFT - IMG_FSHIFT;
+	s->s_fsbtodb	 = IMG_FSHIFT - 9;
+	s->s_sbsize	 = sizeof (*s);
+	s->s_nindir	 = IMG_NINDIR;
+	s->s_inopb	 = IMG_BSIZE / 128;
+	s->s_cgsize	 = sizeof (struct ufs1_cg_v2) + IMG_IPG / 8 +
+			   IMG_FPG / 8;
+	s->s_ipg	 = IMG_IPG;
+	s->s_fpg	 = IMG_FPG;
+	s->s_maxembedded = 60;
+	s->s_inodefmt	 = 2;
+	s->s_magic	 = UFS1_SB_MAGIC;
+
+	for (cgx = 0; cgx < IMG_NCG; ++cgx)
+		img_group (o, cgx, &s->s_cstotal);
+}
+
+static int img_save (const struct image *o, const char *path)
+{
+	int fd, ok;
+
+	if ((fd = open (path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1)
+		return 0;
+
+	ok = write (fd, o->data, IMG_SIZE) == IMG_SIZE;
+	return close (fd) == 0 && ok;
+}
+
+static int img_make (void)
+{
+	struct image o;
+	uint32_t cgx;
+	int ok;
+
+	memset (&o, 0, sizeof (o));
+
+	if ((o.data = calloc (1, IMG_SIZE)) == NULL)
+		return 0;
+
+	for (cgx = 0; cgx < IMG_NCG; ++cgx)
+		o.next[cgx] = cgx * IMG_FPG + IMG_DBLKNO;
+
+	o.used[0] = o.used[1] = o.used[2] = 1;
+
+	img_file (&o, INO_SMALL, SMALL_SIZE);
+	img_file (&o, INO_BIG, BIG_SIZE);
+	img_link (&o, INO_LINK, LINK_TARGET);
+	img_file (&o, INO_OTHER, OTHER_SIZE);
+	img_super (&o);
+
+	ok = img_save (&o, img_path);
+
+	((struct ufs1_sb_v2 *) (o.data + 8192))->s_magic = 0;
+	ok = ok && img_save (&o, bad_path);
+
+	free (o.data);
+	return ok;
+}
+
+static int check_sb (int mode)
+{
+	struct ufs1_sb s;
+	int dev, ok;
+
+	if ((dev = dev_block_open (img_path, mode)) == -1 ||
+	    !ufs1_sb_init (&s, dev)) {
+		fprintf (stderr, "E: cannot open generated image\n");
+		return 0;
+	}
+
+	ok = s.ncg == IMG_NCG && s.ipg == IMG_IPG && s.fpg == IMG_FPG &&
+	     s.bshift == IMG_BSHIFT && s.fshift == IMG_FSHIFT &&
+	     s.dblkno == IMG_DBLKNO;
+
+	if (!ok)
+		fprintf (stderr, "E: super block parsed wrong\n");
+
+	ufs1_sb_fini (&s);
+	return ok;
+}
+
+/*
+ * A corrupt super block must be rejected, and the device closed, after
+ * the super block buffer is released
+ */
+static int check_bad_sb (int mode)
+{
+	struct ufs1_sb s;
+	int dev;
+
+	if ((dev = dev_block_open (bad_path, mode)) == -1)
+		return 0;
+
+	if (ufs1_sb_init (&s, dev)) {
+		fprintf (stderr, "E: corrupt super block accepted\n");
+		ufs1_sb_fini (&s);
+		return 0;
+	}
+
+	return 1;
+}
+
+/*
+ * Marker stored into in-core copy of inode survives as long as the node
+ * stays in cache
+ */
+#define NODE_MARK	0x5eed
+
+static struct ufs1_node *node_get (const struct ufs1_sb *s, uint32_t ino,
+				   int mark)
+{
+	struct ufs1_node *o;
+
+	if ((o = ufs1_node_get (s, ino)) != NULL && mark)
+		o->inode.i_gen = NODE_MARK;
+
+	return o;
+}
+
+static int node_cached (const struct ufs1_sb *s, uint32_t ino)
+{
+	struct ufs1_node *o;
+	int hit;
+
+	if ((o = ufs1_node_get (s, ino)) == NULL)
+		return -1;
+
+	hit = o->inode.i_gen == NODE_MARK;
+	ufs1_node_put (o);
+	return hit;
+}
+
+static int check_nodes (const struct ufs1_sb *s)
+{
+	struct ufs1_node *a, *b;
+	int ok;
+
+	ufs1_node_limit (2);
+
+	/* miss loads the inode, hit while referenced returns the same node */
+	ok = (a = node_get (s, INO_BIG, 1)) != NULL &&
+	     a->inode.i_size == BIG_SIZE && a->type == DT_REG &&
+	     a->nblocks == (BIG_SIZE + IMG_BSIZE - 1) / IMG_BSIZE &&
+	     (b = node_get (s, INO_BIG, 0)) == a && a->ref == 2;
+
+	if (!ok) {
+		fprintf (stderr, "E: node lookup failed\n");
+		return 0;
+	}
+
+	ufs1_node_put (b);
+	ufs1_node_put (a);
+
+	ok = ufs1_node_get (s, IMG_NCG * IMG_IPG) == NULL &&
+	     ufs1_node_get (s, UINT32_MAX) == NULL;
+
+	if (!ok)
+		fprintf (stderr, "E: node out of inode table returned\n");
+
+	/* idle node hits until more recently released ones push it out */
+	ok = ok && node_cached (s, INO_BIG) == 1 &&
+	     node_cached (s, INO_SMALL) == 0 &&
+	     node_cached (s, INO_LINK)  == 0 &&
+	     node_cached (s, INO_OTHER) == 0 &&
+	     node_cached (s, INO_BIG)   == 0;
+
+	if (!ok)
+		fprintf (stderr, "E: idle node eviction failed\n");
+
+	/* purge drops idle nodes of device */
+	ok = ok && (a = node_get (s, INO_SMALL, 1)) != NULL;
+
+	if (ok) {
+		ufs1_node_put (a);
+		ufs1_node_purge (s->dev);
+		ok = node_cached (s, INO_SMALL) == 0;
+	}
+
+	if (!ok)
+		fprintf (stderr, "E: node purge failed\n");
+
+	ufs1_node_limit (4096);
+	return ok;
+}
+
+/*
+ * Block of file is mapped right if it is a hole where generator left it,
+ * or it holds the data generator wrote for it
+ */
+static int block_valid (const struct ufs1_sb *s, uint32_t ino, uint64_t i,
+			int32_t frag)
+{
+	const uint64_t pos = i << IMG_BSHIFT;
+	uint8_t buf[8];
+	size_t j;
+
+	if (frag <= 0)
+		return frag == 0 && img_hole (ino, i);
+
+	if (img_hole (ino, i) ||
+	    dev_block_read (s->dev, buf, sizeof (buf),
+			    (off_t) frag << IMG_FSHIFT) != sizeof (buf))
+		return 0;
+
+	for (j = 0; j < sizeof (buf); ++j)
+		if (buf[j] != img_byte (ino, pos + j))
+			return 0;
+
+	return 1;
+}
+
+static int check_node_block (const struct ufs1_sb *s)
+{
+	const uint64_t count = (BIG_SIZE + IMG_BSIZE - 1) / IMG_BSIZE;
+	struct ufs1_node *o;
+	uint64_t i;
+	int32_t frag;
+	int ok = 1;
+
+	if ((o = ufs1_node_get (s, INO_BIG)) == NULL)
+		return 0;
+
+	/* forward, then backward to switch cached indirect blocks */
+	for (i = 0; ok && i < count; ++i) {
+		frag = ufs1_node_block (o, i);
+		ok = block_valid (s, INO_BIG, i, frag) &&
+		     frag == ufs1_inode_block (s, &o->inode, i);
+	}
+
+	for (i = count; ok && i-- > 0;)
+		ok = block_valid (s, INO_BIG, i, ufs1_node_block (o, i));
+
+	if (!ok)
+		fprintf (stderr, "E: block %llu mapped wrong\n",
+			 (unsigned long long) i);
+
+	ufs1_node_put (o);
+	return ok;
+}
+
+/*
+ * Map range with at most n extents per call, continuing from the end of
+ * last extent, and check that extents cover the range clipped to file
+ * size in order, agree with single block mapping, and are merged
+ */
+static int check_range (const struct ufs1_sb *s, const struct ufs1_inode *in,
+			uint64_t first, uint64_t count, size_t n)
+{
+	const uint64_t nblocks = (in->i_size + IMG_BSIZE - 1) / IMG_BSIZE;
+	const uint64_t end = first + count < nblocks ? first + count : nblocks;
+	struct ufs1_extent v[64], *e, *prev = NULL;
+	uint64_t next = first, i;
+	ssize_t got;
+
+	while (next < end) {
+		if ((got = ufs1_inode_map_range (s, in, next, end - next, v,
+						 n)) <= 0)
+			return 0;
+
+		for (e = v; e < v + got; prev = e++, next += e[-1].count) {
+			if (e->block != next || e->count == 0 ||
+			    e->block + e->count > end)
+				return 0;
+
+			for (i = 0; i < e->count; ++i)
+				if (ufs1_inode_block (s, in, e->block + i) !=
+				    (e->frag == 0 ? 0 : e->frag + i * IMG_FRAG))
+					return 0;
+
+			/* adjacent extents of one call are never contiguous */
+			if (prev != NULL && e > v && (e->frag == 0) ==
+			    (prev->frag == 0) && (e->frag == 0 ||
+			    prev->frag + prev->count * IMG_FRAG == e->frag))
+				return 0;
+		}
+	}
+
+	/* range past the end of file is empty */
+	return end < nblocks || ufs1_inode_map_range (s, in, end, 1, v, n) == 0;
+}
+
+static int check_map_range (const struct ufs1_sb *s)
+{
+	struct ufs1_node *o;
+	int ok;
+
+	if ((o = ufs1_node_get (s, INO_BIG)) == NULL)
+		return 0;
+
+	ok = check_range (s, &o->inode, 0, UINT64_MAX / 2, 64) &&
+	     check_range (s, &o->inode, 0, 2000, 1) &&
+	     check_range (s, &o->inode, 15, 30, 2) &&
+	     check_range (s, &o->inode, 1030, 25, 3) &&
+	     check_range (s, &o->inode, 1099, 10, 64);
+
+	if (!ok)
+		fprintf (stderr, "E: range mapped wrong\n");
+
+	ufs1_node_put (o);
+	return ok;
+}
+
+static int file_valid (uint32_t ino, uint64_t pos, const uint8_t *p,
+		       size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < len; ++i, ++pos)
+		if (p[i] != (img_hole (ino, pos >> IMG_BSHIFT) ? 0 :
+			     img_byte (ino, pos)))
+			return 0;
+
+	return 1;
+}
+
+/*
+ * Read range of file and check the result: expect is the number of bytes
+ * before the end of file
+ */
+static int file_read (const struct ufs1_sb *s, uint32_t ino, off_t offset,
+		      uint8_t *buf, size_t count, size_t expect)
+{
+	struct ufs1_node *o;
+	ssize_t len;
+
+	if ((o = ufs1_node_get (s, ino)) == NULL)
+		return 0;
+
+	memset (buf, 0xa5, count);
+	len = ufs1_file_read (s, &o->inode, offset, buf, count);
+	ufs1_node_put (o);
+
+	if (len != expect || !file_valid (ino, offset, buf, len)) {
+		fprintf (stderr, "E: read of inode %lu at %lld failed\n",
+			 (unsigned long) ino, (long long) offset);
+		return 0;
+	}
+
+	return 1;
+}
+
+static int check_link (const struct ufs1_sb *s)
+{
+	struct ufs1_node *o;
+	char buf[16];
+	int ok;
+
+	if ((o = ufs1_node_get (s, INO_LINK)) == NULL)
+		return 0;
+
+	ok = ufs1_file_read (s, &o->inode, 0, buf, sizeof (buf)) == 5 &&
+	     memcmp (buf, LINK_TARGET, 5) == 0 &&
+	     ufs1_file_read (s, &o->inode, 2, buf, sizeof (buf)) == 3 &&
+	     memcmp (buf, LINK_TARGET + 2, 3) == 0 &&
+	     ufs1_file_read (s, &o->inode, 5, buf, sizeof (buf)) == 0;
+
+	if (!ok)
+		fprintf (stderr, "E: short link read failed\n");
+
+	ufs1_node_put (o);
+	return ok;
+}
+
+/*
+ * Read whole files and ranges across holes and the first blocks mapped
+ * by single and double indirect blocks, with aligned and unaligned
+ * buffers and offsets
+ */
+static int check_file_read (const struct ufs1_sb *s)
+{
+	const off_t ind1 = 12 * IMG_BSIZE;
+	const off_t ind2 = (12 + IMG_NINDIR) * (off_t) IMG_BSIZE;
+	void *p;
+	uint8_t *buf;
+	int ok;
+
+	if (posix_memalign (&p, IMG_BSIZE, BIG_SIZE + IMG_BSIZE) != 0)
+		return 0;
+
+	buf = p;
+	ok = file_read (s, INO_BIG,   0, buf, BIG_SIZE + 100, BIG_SIZE) &&
+	     file_read (s, INO_BIG,   0, buf + 1, BIG_SIZE, BIG_SIZE) &&
+	     file_read (s, INO_BIG, ind1 - 7, buf + 3, 40 * IMG_BSIZE,
+			40 * IMG_BSIZE) &&
+	     file_read (s, INO_BIG, ind1, buf, 30 * IMG_BSIZE,
+			30 * IMG_BSIZE) &&
+	     file_read (s, INO_BIG, ind2 - 5, buf + 5, 100 * IMG_BSIZE,
+			BIG_SIZE - ind2 + 5) &&
+	     file_read (s, INO_BIG, 21 * IMG_BSIZE + 1, buf, 100, 100) &&
+	     file_read (s, INO_BIG, BIG_SIZE - 10, buf, 100, 10) &&
+	     file_read (s, INO_BIG, BIG_SIZE, buf, 100, 0) &&
+	     file_read (s, INO_SMALL, 0, buf, IMG_BSIZE * 2, SMALL_SIZE) &&
+	     file_read (s, INO_SMALL, IMG_BSIZE - 6, buf + 1, 100, 100) &&
+	     file_read (s, INO_OTHER, 0, buf, OTHER_SIZE, OTHER_SIZE) &&
+	     check_link (s);
+
+	free (p);
+	return ok;
+}
+
+struct visit {
+	uint32_t	next;
+	int		ok;
+};
+
+static void *visit_cg (void *cookie, uint32_t cgx, const struct ufs1_cg *c)
+{
+	uint32_t ifree;
+
+	if (c == NULL || c->cgx != cgx ||
+	    (ifree = ufs1_cg_ifree (c)) != c->stat.cs_nifree)
+		return NULL;
+
+	if (cgx == 0)
+		usleep (2000);  /* let the following groups complete first */
+
+	return (void *) (uintptr_t) (ifree + 1);
+}
+
+static void visit_done (void *cookie, uint32_t cgx, void *result)
+{
+	struct visit *v = cookie;
+	const uintptr_t ifree = (uintptr_t) result - 1;
+
+	v->ok &= cgx == v->next++ && result != NULL &&
+		 (cgx == 0 ? ifree < IMG_IPG :
+			     ifree == IMG_IPG - (cgx == INO_OTHER / IMG_IPG));
+}
+
+/*
+ * Visit all groups serially and with pools of threads, results must be
+ * delivered once per group in order of groups
+ */
+static int check_cg_visit (struct ufs1_sb *s)
+{
+	static const unsigned threads[] = { 1, 0, 2, 3, 4, 64 };
+	struct visit v;
+	size_t i;
+
+	for (i = 0; i < ARRAY_SIZE (threads); ++i) {
+		v.next = 0;
+		v.ok   = 1;
+
+		if (!ufs1_cg_visit (s, threads[i], visit_cg, visit_done, &v) ||
+		    !v.ok || v.next != IMG_NCG) {
+			fprintf (stderr, "E: visit with %u threads failed\n",
+				 threads[i]);
+			return 0;
+		}
+	}
+
+	return 1;
+}
+
+/*
+ * Flip byte 10 of device block at pos with delayed or immediate write
+ */
+static int flip_byte (int dev, off_t pos, int defer)
+{
+	struct bio *b;
+	int ok;
+
+	if ((b = bio_write (dev, pos, IMG_BSIZE, true)) == NULL)
+		return 0;
+
+	((uint8_t *) b->bio_data)[10] ^= 0xff;
+	ok = defer ? bio_write_defer (b) : bio_write_end (b, true);
+	bio_put (b);
+	return ok;
+}
+
+static int read_byte (struct ufs1_sb *s, struct ufs1_node *o, int flipped)
+{
+	const uint8_t want = img_byte (INO_OTHER, IMG_BSIZE + 10);
+	uint8_t buf[IMG_BSIZE];
+
+	return ufs1_file_read (s, &o->inode, IMG_BSIZE, buf, IMG_BSIZE) ==
+	       IMG_BSIZE && buf[10] == (flipped ? (uint8_t) ~want : want);
+}
+
+/*
+ * Delayed writes, writes in flight of cached blocks and of released ones
+ * must be visible to the following file read, every step flips the byte
+ * back and forth, thus the image is restored at the end
+ */
+static int check_file_write (void)
+{
+	struct ufs1_sb s;
+	struct ufs1_node *o;
+	int dev, ok;
+	off_t pos;
+
+	if ((dev = dev_block_open (img_path, DEV_WRITE)) == -1 ||
+	    !ufs1_sb_init (&s, dev))
+		return 0;
+
+	if ((o = ufs1_node_get (&s, INO_OTHER)) == NULL) {
+		ufs1_sb_fini (&s);
+		return 0;
+	}
+
+	pos = (off_t) ufs1_node_block (o, 1) << IMG_FSHIFT;
+
+	if (!(ok = flip_byte (dev, pos, 1) && read_byte (&s, o, 1)))
+		fprintf (stderr, "E: delayed write is not visible to read\n");
+
+	if (ok && !(ok = flip_byte (dev, pos, 0) && read_byte (&s, o, 0)))
+		fprintf (stderr, "E: cached write is not visible to read\n");
+
+	if (ok) {
+		ok = flip_byte (dev, pos, 0);
+		bio_cache_purge (dev);  /* release block with write in flight */
+
+		if (!(ok = ok && read_byte (&s, o, 1)))
+			fprintf (stderr,
+				 "E: released write is not visible to read\n");
+	}
+
+	ok = flip_byte (dev, pos, 0) && bio_sync_dev (dev) && ok;
+
+	ufs1_node_put (o);
+	ufs1_sb_fini (&s);
+	return ok;
+}
+
+static int check_image (int mode)
+{
+	struct ufs1_sb s;
+	int dev, ok;
+
+	if ((dev = dev_block_open (img_path, mode)) == -1 &&
+	    (mode & DEV_DIRECT) != 0 && errno == EINVAL) {
+		fprintf (stderr, "I: direct I/O is not supported, skipped\n");
+		return 1;
+	}
+
+	if (dev == -1 || !ufs1_sb_init (&s, dev))
+		return 0;
+
+	ok = check_nodes (&s) && check_node_block (&s) &&
+	     check_map_range (&s) && check_file_read (&s) &&
+	     check_cg_visit (&s);
+
+	ufs1_sb_fini (&s);
+	return ok;
+}
+
+int main (int argc, char *argv[])
+{
+	int ok;
+
+	if (!img_make ()) {
+		perror ("E: cannot make image");
+		return 1;
+	}
+
+	ok = check_sb (0) && check_sb (DEV_MMAP) &&
+	     check_bad_sb (0) && check_bad_sb (DEV_MMAP) &&
+	     check_image (0) && check_image (DEV_MMAP) &&
+	     check_image (DEV_DIRECT) &&
+	     check_file_write () && check_image (0);
+
+	unlink (img_path);
+	unlink (bad_path);
+	return ok ? 0 : 1;
+}
@@ -6,68 +6,224 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
+#include <sys/param.h>
+
+#include <marten/mutex.h>
+
 #include "ufs1-inode.h"
 
+/*
+ * Return entry i of indirect block at given fragment. With map cache the
+ * last indirect block of every level is kept pulled, thus sequential
+ * access reads every indirect block once.
+ */
 static int32_t
-ufs1_block_map (const struct ufs1_sb *sb, const struct ufs1_inode *o,
-		uint64_t at, unsigned order, size_t i)
+ufs1_block_map (const struct ufs1_sb *sb, struct ufs1_bmap *m, unsigned level,
+		int32_t at, unsigned order, size_t i)
 {
 	const off_t  pos   = (off_t) at << sb->fshift;
 	const size_t bsize = (size_t) 4 << order;
 	int32_t *db, frag;
 
-	if ((db = dev_block_get (sb->dev, pos, bsize, 1)) == NULL)
+	if (at <= 0)
+		return at;
+
+	if (m != NULL && m->frag[level] == at)
+		return m->data[level][i];
+
+	if ((db = dev_block_get (sb->dev, pos, bsize, DEV_PULL | DEV_META)) == NULL)
 		return -1;
 
 	frag = db[i];
-	dev_block_put (db, bsize);
+
+	if (m == NULL) {
+		dev_block_put (db, bsize);
+		return frag;
+	}
+
+	if (m->data[level] != NULL)
+		dev_block_put (m->data[level], bsize);
+
+	m->frag[level] = at;
+	m->data[level] = db;
 	return frag;
 }
 
 static int32_t
-ufs1_inode_block_i2 (const struct ufs1_sb *sb, const struct ufs1_inode *o,
-		     uint64_t i0, unsigned order, size_t mask)
+ufs1_inode_block_i2 (const struct ufs1_sb *sb, struct ufs1_bmap *m,
+		     const struct ufs1_inode *o, uint64_t i0, unsigned order,
+		     size_t mask)
 {
 	const uint64_t i1 = i0 >> order, i2 = i1 >> order, i3 = i2 >> order;
 	int32_t l0, l1, l2 = o->i_ib[2];
 
 	return	i3 != 0 ? 0 :
-		(l1 = ufs1_block_map (sb, o, l2, order, i2       )) <= 0 ? l1 :
-		(l0 = ufs1_block_map (sb, o, l1, order, i1 & mask)) <= 0 ? l0 :
-		(     ufs1_block_map (sb, o, l0, order, i0 & mask));
+		(l1 = ufs1_block_map (sb, m, 2, l2, order, i2       )) <= 0 ? l1 :
+		(l0 = ufs1_block_map (sb, m, 1, l1, order, i1 & mask)) <= 0 ? l0 :
+		(     ufs1_block_map (sb, m, 0, l0, order, i0 & mask));
 }
 
 static int32_t
-ufs1_inode_block_i1 (const struct ufs1_sb *sb, const struct ufs1_inode *o,
-		     uint64_t i0, unsigned order, uint64_t count)
+ufs1_inode_block_i1 (const struct ufs1_sb *sb, struct ufs1_bmap *m,
+		     const struct ufs1_inode *o, uint64_t i0, unsigned order,
+		     uint64_t count)
 {
 	const size_t mask = ((size_t) 1 << order) - 1;
 	const uint64_t i1 = i0 >> order;
 	int32_t l0, l1 = o->i_ib[1];
 
 	return	i0 >= count ?
-		ufs1_inode_block_i2 (sb, o, i0 - count, order, mask) :
-		(l0 = ufs1_block_map (sb, o, l1, order, i1       )) <= 0 ? l0 :
-		(     ufs1_block_map (sb, o, l0, order, i0 & mask));
+		ufs1_inode_block_i2 (sb, m, o, i0 - count, order, mask) :
+		(l0 = ufs1_block_map (sb, m, 1, l1, order, i1       )) <= 0 ? l0 :
+		(     ufs1_block_map (sb, m, 0, l0, order, i0 & mask));
 }
 
 static int32_t
-ufs1_inode_block_i0 (const struct ufs1_sb *sb, const struct ufs1_inode *o,
-		     uint64_t i0, unsigned order)
+ufs1_inode_block_i0 (const struct ufs1_sb *sb, struct ufs1_bmap *m,
+		     const struct ufs1_inode *o, uint64_t i0, unsigned order)
 {
 	const uint64_t count = (uint64_t) 1 << order;
 	int32_t l0 = o->i_ib[0];
 
 	return	i0 >= count ?
-		ufs1_inode_block_i1 (sb, o, i0 - count, order, count << order) :
-		ufs1_block_map (sb, o, l0, order, i0);
+		ufs1_inode_block_i1 (sb, m, o, i0 - count, order, count << order) :
+		ufs1_block_map (sb, m, 0, l0, order, i0);
 }
 
-int32_t ufs1_inode_block (const struct ufs1_sb *sb, const struct ufs1_inode *o,
-			  uint64_t i)
+static int32_t
+ufs1_inode_block_map (const struct ufs1_sb *sb, struct ufs1_bmap *m,
+		      const struct ufs1_inode *o, uint64_t i)
 {
 	const size_t count = ARRAY_SIZE (o->i_db);
 
 	return	o->i_size <= 0 ? 0 : i < count ? o->i_db[i] :
-		ufs1_inode_block_i0 (sb, o, i - count, sb->bshift - 2);
+		ufs1_inode_block_i0 (sb, m, o, i - count, sb->bshift - 2);
+}
+
+int32_t ufs1_inode_block (const struct ufs1_sb *sb, const struct ufs1_inode *o,
+			  uint64_t i)
+{
+	return ufs1_inode_block_map (sb, NULL, o, i);
+}
+
+/*
+ * Range mapping walks the trees of indirect blocks once, every pointer of
+ * tree covers 2^(order * level) blocks, where level is the distance to
+ * data blocks. Runs of physically contiguous blocks and runs of holes are
+ * merged into extents.
+ */
+struct ufs1_map {
+	const struct ufs1_sb	*sb;
+	struct ufs1_extent	*v;
+	size_t			n, count;
+	unsigned		order;
+	uint64_t		first, end;
+};
+
+static int ufs1_map_add (struct ufs1_map *m, uint64_t block, int32_t frag,
+			 uint64_t count)
+{
+	const unsigned shift = m->sb->bshift - m->sb->fshift;
+	struct ufs1_extent *e = m->v + m->count - 1;
+
+	if (m->count > 0 && e->block + e->count == block &&
+	    (frag == 0 ? e->frag == 0 :
+	     e->frag != 0 && e->frag + (e->count << shift) == frag)) {
+		e->count += count;
+		return 1;
+	}
+
+	if (m->count == m->n)
+		return 0;
+
+	e = m->v + m->count++;
+	e->block = block;
+	e->frag  = frag;
+	e->count = count;
+	return 1;
+}
+
+static int
+ufs1_map_walk (struct ufs1_map *m, int32_t at, unsigned level, uint64_t base)
+{
+	const uint64_t span = (uint64_t) 1 << (m->order * level);
+	const uint64_t head = MAX (base, m->first);
+	const uint64_t tail = MIN (base + span, m->end);
+	const size_t bsize = (size_t) 1 << m->sb->bshift;
+	uint64_t child, i, last;
+	int32_t *db;
+	int ok = 1;
+
+	if (head >= tail)
+		return 1;
+
+	if (at < 0)
+		return -1;
+
+	if (at == 0 || level == 0)
+		return ufs1_map_add (m, head, at, tail - head);
+
+	db = dev_block_get (m->sb->dev, (off_t) at << m->sb->fshift, bsize,
+			    DEV_PULL | DEV_META);
+	if (db == NULL)
+		return -1;
+
+	child = span >> m->order;
+	last  = (tail - 1 - base) / child;
+
+	for (i = (head - base) / child; ok > 0 && i <= last; ++i)
+		ok = ufs1_map_walk (m, db[i], level - 1, base + i * child);
+
+	dev_block_put (db, bsize);
+	return ok;
+}
+
+ssize_t ufs1_inode_map_range (const struct ufs1_sb *sb,
+			      const struct ufs1_inode *o, uint64_t first,
+			      uint64_t count, struct ufs1_extent *v, size_t n)
+{
+	const uint64_t size = howmany (o->i_size, (uint64_t) 1 << sb->bshift);
+	const size_t ndb = ARRAY_SIZE (o->i_db);
+	struct ufs1_map m = { sb, v, n, 0, sb->bshift - 2, first };
+	uint64_t base, i;
+	unsigned level;
+	int ok = 1;
+
+	m.end = count < size - MIN (first, size) ? first + count : size;
+
+	for (i = first; ok > 0 && i < MIN (ndb, m.end); ++i)
+		ok = ufs1_map_add (&m, i, o->i_db[i], 1);
+
+	for (
+		level = 1, base = ndb;
+		ok > 0 && level <= ARRAY_SIZE (o->i_ib) && base < m.end;
+		base += (uint64_t) 1 << (m.order * level), ++level
+	)
+		ok = ufs1_map_walk (&m, o->i_ib[level - 1], level, base);
+
+	return ok < 0 ? -1 : m.count;
+}
+
+void ufs1_bmap_fini (const struct ufs1_sb *sb, struct ufs1_bmap *m)
+{
+	const size_t bsize = (size_t) 1 << sb->bshift;
+	unsigned level;
+
+	for (level = 0; level < ARRAY_SIZE (m->data); ++level)
+		if (m->data[level] != NULL) {
+			dev_block_put (m->data[level], bsize);
+			m->frag[level] = 0;
+			m->data[level] = NULL;
+		}
+}
+
+int32_t ufs1_node_block (struct ufs1_node *o, uint64_t i)
+{
+	int32_t frag;
+
+	mutex_lock (&o->lock);
+	frag = ufs1_inode_block_map (o->sb, &o->bmap, &o->inode, i);
+	mutex_unlock (&o->lock);
+
+	return frag;
 }
@@ -0,0 +1,242 @@
+/*
+ * UFS1 In-Core Inode Cache
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <string.h>
+
+#include <sys/param.h>
+
+#include <fs/ufs1-dirent-v2.h>
+#include <marten/hash.h>
+#include <marten/mutex.h>
+#include <marten/pool.h>
+
+#include "ufs1-inode.h"
+
+#define UFS1_NODE_ORDER		10	/* hash table order		*/
+#define UFS1_NODE_LIMIT		4096	/* default max idle nodes	*/
+
+#define UFS1_NODE_SIZE		(1UL << UFS1_NODE_ORDER)
+
+/*
+ * Nodes are chained into the hash table by device and inode number. Nodes
+ * not referenced anymore are kept on the idle list in order of release and
+ * evicted from its head when there are too many of them, thus the hot
+ * inodes stay in core.
+ */
+static mutex_t node_lock = MUTEX_INIT;
+static struct ufs1_node *node_table[UFS1_NODE_SIZE];
+static struct ufs1_node *idle_head, **idle_tail = &idle_head;
+static size_t idle_count, idle_limit = UFS1_NODE_LIMIT;
+
+static size_t ufs1_node_index (int dev, uint32_t ino)
+{
+	uint32_t iv = 0;
+
+	iv = oat_hash_step (iv, dev);
+	iv = oat_hash_step (iv, ino);
+
+	return oat_hash_final (iv) & (UFS1_NODE_SIZE - 1);
+}
+
+static struct ufs1_node **ufs1_node_slot (int dev, uint32_t ino)
+{
+	struct ufs1_node **p = node_table + ufs1_node_index (dev, ino);
+
+	for (; *p != NULL; p = &(*p)->next)
+		if ((*p)->dev == dev && (*p)->ino == ino)
+			break;
+
+	return p;
+}
+
+static void ufs1_idle_link (struct ufs1_node *o)
+{
+	o->inext = NULL;
+	o->iprev = idle_tail;
+	*idle_tail = o;
+	idle_tail = &o->inext;
+	++idle_count;
+}
+
+static void ufs1_idle_unlink (struct ufs1_node *o)
+{
+	if ((*o->iprev = o->inext) != NULL)
+		o->inext->iprev = o->iprev;
+	else
+		idle_tail = o->iprev;
+
+	--idle_count;
+}
+
+/*
+ * Unlink idle nodes over the limit from cache and return them as a list
+ * chained by next to be freed outside of lock
+ */
+static struct ufs1_node *ufs1_idle_trim (size_t limit)
+{
+	struct ufs1_node *list = NULL, *o;
+
+	while (idle_count > limit) {
+		o = idle_head;
+		ufs1_idle_unlink (o);
+		*ufs1_node_slot (o->dev, o->ino) = o->next;
+
+		o->next = list;
+		list = o;
+	}
+
+	return list;
+}
+
+static void ufs1_node_free (struct ufs1_node *list)
+{
+	struct ufs1_node *next;
+
+	for (; list != NULL; list = next) {
+		next = list->next;
+		pool_free (list, sizeof (*list));
+	}
+}
+
+static struct ufs1_node *ufs1_node_load (const struct ufs1_sb *sb, uint32_t ino)
+{
+	const uint32_t cgx = ino / sb->ipg, n = ino % sb->ipg;
+	const size_t size  = sizeof (struct ufs1_inode);
+	const off_t  base  = ufs1_cg_iblkno (sb, cgx);
+	const off_t  pos   = (base << sb->fshift) + n * size;
+	const int    mode  = DEV_PULL | DEV_META;
+	struct ufs1_inode *in;
+	struct ufs1_node *o;
+
+	if ((o = pool_alloc (sizeof (*o))) == NULL)
+		return NULL;
+
+	if ((in = dev_block_get (sb->dev, pos, size, mode)) == NULL)
+		goto no_inode;
+
+	o->inode = *in;
+	dev_block_put (in, size);
+
+	o->sb      = sb;
+	o->dev     = sb->dev;
+	o->ino     = ino;
+	o->ref     = 1;
+	o->type    = IFTODT (o->inode.i_mode);
+	o->nblocks = howmany (o->inode.i_size, (uint64_t) 1 << sb->bshift);
+
+	mutex_init (&o->lock);
+	memset (&o->bmap, 0, sizeof (o->bmap));
+	return o;
+no_inode:
+	pool_free (o, sizeof (*o));
+	return NULL;
+}
+
+struct ufs1_node *ufs1_node_get (const struct ufs1_sb *sb, uint32_t ino)
+{
+	struct ufs1_node **p, *o;
+
+	if (ino >= (uint64_t) sb->ipg * sb->ncg)
+		return NULL;
+
+	mutex_lock (&node_lock);
+
+	if ((o = *ufs1_node_slot (sb->dev, ino)) != NULL) {
+		if (o->ref++ == 0)
+			ufs1_idle_unlink (o);
+
+		mutex_unlock (&node_lock);
+		return o;
+	}
+
+	mutex_unlock (&node_lock);
+
+	if ((o = ufs1_node_load (sb, ino)) == NULL)
+		return NULL;
+
+	mutex_lock (&node_lock);
+
+	if (*(p = ufs1_node_slot (sb->dev, ino)) == NULL) {
+		o->next = NULL;
+		*p = o;
+	}
+	else {  /* loaded by another thread meanwhile */
+		pool_free (o, sizeof (*o));
+
+		if ((o = *p)->ref++ == 0)
+			ufs1_idle_unlink (o);
+	}
+
+	mutex_unlock (&node_lock);
+	return o;
+}
+
+/*
+ * Block map of idle node is detached under lock and its blocks are
+ * released outside of it, as the node itself may be freed by then
+ */
+void ufs1_node_put (struct ufs1_node *o)
+{
+	struct ufs1_node *list = NULL;
+	const struct ufs1_sb *sb = NULL;
+	struct ufs1_bmap m;
+
+	mutex_lock (&node_lock);
+
+	if (--o->ref == 0) {
+		sb = o->sb;
+		m  = o->bmap;
+		memset (&o->bmap, 0, sizeof (o->bmap));
+
+		ufs1_idle_link (o);
+		list = ufs1_idle_trim (idle_limit);
+	}
+
+	mutex_unlock (&node_lock);
+
+	if (sb != NULL)
+		ufs1_bmap_fini (sb, &m);
+
+	ufs1_node_free (list);
+}
+
+void ufs1_node_limit (size_t count)
+{
+	struct ufs1_node *list;
+
+	mutex_lock (&node_lock);
+
+	idle_limit = count;
+	list = ufs1_idle_trim (idle_limit);
+
+	mutex_unlock (&node_lock);
+	ufs1_node_free (list);
+}
+
+void ufs1_node_purge (int dev)
+{
+	struct ufs1_node *list = NULL, *o, *next;
+
+	mutex_lock (&node_lock);
+
+	for (o = idle_head; o != NULL; o = next) {
+		next = o->inext;
+
+		if (o->dev != dev)
+			continue;
+
+		ufs1_idle_unlink (o);
+		*ufs1_node_slot (dev, o->ino) = o->next;
+
+		o->next = list;
+		list = o;
+	}
+
+	mutex_unlock (&node_lock);
+	ufs1_node_free (list);
+}
@@ -0,0 +1,77 @@
+/*
+ * UFS1 Inode Table Scan
+ *
+ * Copyright (c) 2024 Alexei A. Smekalkine <ikle@ikle.ru>
+ *
+ * SPDX-License-Identifier: BSD-2-Clause
+ */
+
+#include <sys/param.h>
+
+#include <marten/bitmap.h>
+
+#include "ufs1-inode.h"
+
+void ufs1_inode_scan_init (struct ufs1_inode_scan *o, const struct ufs1_cg *c)
+{
+	o->cg    = c;
+	o->count = 0;
+	o->base  = 0;
+	o->next  = 0;
+	o->ok    = 1;
+}
+
+void ufs1_inode_scan_fini (struct ufs1_inode_scan *o)
+{
+	const size_t bsize = (size_t) 1 << o->cg->sb->bshift;
+
+	for (; o->count > 0; --o->count)
+		dev_block_put (o->block[o->count - 1], bsize);
+}
+
+/*
+ * Pull the span of inode blocks starting with the block of inode n
+ */
+static int ufs1_inode_scan_pull (struct ufs1_inode_scan *o, uint32_t n)
+{
+	const struct ufs1_sb *sb = o->cg->sb;
+	const size_t  bsize = (size_t) 1 << sb->bshift;
+	const off_t   itab  = ufs1_cg_iblkno (sb, o->cg->cgx);
+	const uint32_t last = howmany (o->cg->ipg, sb->inopb);
+	const uint32_t i    = n / sb->inopb;
+	const uint32_t span = MIN (last - i, UFS1_INODE_SPAN);
+	const off_t    pos  = (itab << sb->fshift) + ((off_t) i << sb->bshift);
+	const int mode = DEV_PULL | DEV_META;
+
+	ufs1_inode_scan_fini (o);
+
+	if (!dev_block_get_many (sb->dev, pos, bsize, span, mode, o->block))
+		return o->ok = 0;
+
+	o->base  = i * sb->inopb;
+	o->count = span;
+	return 1;
+}
+
+struct ufs1_inode *ufs1_inode_scan_next (struct ufs1_inode_scan *o)
+{
+	const struct ufs1_cg *c = o->cg;
+	const uint32_t inopb = c->sb->inopb;
+	const uint8_t *imap = ufs1_cg_imap (c);
+	struct ufs1_inode *block;
+	uint32_t i;
+
+	if (!o->ok ||
+	    (o->next = bitmap_next_set (imap, o->next, c->ipg)) >= c->ipg)
+		return NULL;
+
+	if ((o->count == 0 || o->next >= o->base + o->count * inopb) &&
+	    !ufs1_inode_scan_pull (o, o->next))
+		return NULL;
+
+	i = o->next - o->base;
+	block = o->block[i / inopb];
+
+	o->n = o->next++;
+	return block + i % inopb;
+}
@@ -12,6 +12,7 @@
 #include <fs/ufs1-cg.h>
 #include <fs/ufs1-inode-v2.h>
 #include <marten/device/block.h>
+#include <marten/mutex.h>
 
 static inline
 struct ufs1_inode *ufs1_cg_inode_get (const struct ufs1_cg *c, int n, int pull)
@@ -20,7 +21,8 @@ struct ufs1_inode *ufs1_cg_inode_get (const struct ufs1_cg *c, int n, int pull)
 	const size_t size = sizeof (struct ufs1_inode);
 	const off_t  pos  = (base << c->sb->fshift) + n * size;
 
-	return dev_block_get (c->sb->dev, pos, size, pull);
+	return dev_block_get (c->sb->dev, pos, size,
+			      pull ? DEV_PULL | DEV_META : 0);
 }
 
 static inline void ufs1_inode_put (struct ufs1_inode *o)
@@ -28,7 +30,108 @@ static inline void ufs1_inode_put (struct ufs1_inode *o)
 	dev_block_put (o, sizeof (*o));
 }
 
+/*
+ * Block map cache: the last indirect block used on every level of tree,
+ * indexed by distance to data blocks
+ */
+struct ufs1_bmap {
+	int32_t		frag[3];
+	int32_t		*data[3];
+};
+
+void ufs1_bmap_fini (const struct ufs1_sb *sb, struct ufs1_bmap *m);
+
+/*
+ * In-core inode: the copy of on-disk inode with derived state, shared by
+ * all users of inode and kept in cache after release while cache limit
+ * of idle nodes set by ufs1_node_limit allows
+ */
+struct ufs1_node {
+	struct ufs1_node	*next;			/* hash chain	*/
+	struct ufs1_node	*inext, **iprev;	/* idle list	*/
+	const struct ufs1_sb	*sb;
+	int			dev;
+	uint32_t		ino;
+	size_t			ref;
+
+	struct ufs1_inode	inode;
+	unsigned		type;		/* DT_* file type	*/
+	uint64_t		nblocks;	/* file size in blocks	*/
+
+	mutex_t			lock;		/* guards bmap		*/
+	struct ufs1_bmap	bmap;
+};
+
+struct ufs1_node *ufs1_node_get (const struct ufs1_sb *sb, uint32_t ino);
+void ufs1_node_put   (struct ufs1_node *o);
+void ufs1_node_limit (size_t count);
+
+/*
+ * Drop idle nodes of device, called by ufs1_sb_fini. Nodes refer to the
+ * super block, thus all nodes of device must be released before it is
+ * finished: referenced nodes are left in cache as is.
+ */
+void ufs1_node_purge (int dev);
+
+/*
+ * Scan of allocated inodes of cylinder group: inode blocks are pulled in
+ * spans of UFS1_INODE_SPAN blocks with one batched request, and the scan
+ * yields pointers into them, the index of returned inode in the group is
+ * stored into n. Spans without allocated inodes are never read. The scan
+ * stops at the end of table, or on read failure with ok cleared.
+ */
+#define UFS1_INODE_SPAN		8
+
+struct ufs1_inode_scan {
+	const struct ufs1_cg	*cg;
+	void			*block[UFS1_INODE_SPAN];
+	uint32_t		count;		/* blocks pulled	*/
+	uint32_t		base;		/* first inode of span	*/
+	uint32_t		next, n;
+	int			ok;
+};
+
+void ufs1_inode_scan_init (struct ufs1_inode_scan *o, const struct ufs1_cg *c);
+void ufs1_inode_scan_fini (struct ufs1_inode_scan *o);
+
+struct ufs1_inode *ufs1_inode_scan_next (struct ufs1_inode_scan *o);
+
 int32_t ufs1_inode_block (const struct ufs1_sb *sb, const struct ufs1_inode *o,
 			  uint64_t i);
 
+/*
+ * Map file blocks [first, first + count) clipped to file size into at most
+ * n extents: runs of physically contiguous blocks, or holes with zero
+ * fragment. Returns number of extents filled, or -1 on read failure. If
+ * extents are exhausted before the end of range, the caller continues
+ * from the end of the last extent.
+ */
+struct ufs1_extent {
+	uint64_t	block;		/* first file block		*/
+	int32_t		frag;		/* first fragment, 0 - hole	*/
+	uint64_t	count;		/* number of blocks		*/
+};
+
+ssize_t ufs1_inode_map_range (const struct ufs1_sb *sb,
+			      const struct ufs1_inode *o, uint64_t first,
+			      uint64_t count, struct ufs1_extent *v, size_t n);
+
+/*
+ * Read file data into caller buffer: every contiguous run of blocks is read
+ * with one request straight into the buffer, holes are zero-filled, and
+ * the content of short symbolic links is taken from inode. Delayed writes
+ * of device are written back first and writes in flight to the range are
+ * waited for, as direct reads bypass the cache.
+ * Returns number of bytes read, which is less than count at the end of
+ * file, or -1 on failure.
+ */
+ssize_t ufs1_file_read (const struct ufs1_sb *sb, const struct ufs1_inode *o,
+			off_t offset, void *buf, size_t count);
+
+/*
+ * Map file block i of node to fragment using block map cache of node, the
+ * cache is released when the node becomes idle
+ */
+int32_t ufs1_node_block (struct ufs1_node *o, uint64_t i);
+
 #endif  /* UFS1_INODE_H */
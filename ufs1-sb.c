@@ -6,29 +6,25 @@
  * SPDX-License-Identifier: BSD-2-Clause
  */
 
-#include <unistd.h>
-
 #include <fs/ufs1-cg-v2.h>
 #include <fs/ufs1-sb.h>
+#include <marten/device/block.h>
+
+#include "ufs1-inode.h"
 
 void ufs1_sb_fini (struct ufs1_sb *o)
 {
-	close (o->dev);
+	ufs1_node_purge (o->dev);
+	dev_block_close (o->dev);
 }
 
 static inline int ufs1_sb_error (struct ufs1_sb *o, const char *reason)
 {
-	ufs1_sb_fini (o);
 	return 0;
 }
 
-int ufs1_sb_init (struct ufs1_sb *o, int dev)
+static int ufs1_sb_parse (struct ufs1_sb *o, const struct ufs1_sb_v2 *s)
 {
-	struct ufs1_sb_v2 buf, *s = &buf;
-
-	if (pread (o->dev = dev, &buf, sizeof (buf), 8192) != sizeof (buf))
-		return ufs1_sb_error (o, "Cannot read super block");
-
 	if (s->s_magic != UFS1_SB_MAGIC)
 		return ufs1_sb_error (o, "Cannot find valid super block magic");
 
@@ -70,3 +66,26 @@ int ufs1_sb_init (struct ufs1_sb *o, int dev)
 	o->stat = s->s_cstotal;
 	return 1;
 }
+
+int ufs1_sb_init (struct ufs1_sb *o, int dev)
+{
+	const size_t size = sizeof (struct ufs1_sb_v2);
+	struct ufs1_sb_v2 *s;
+	int ok;
+
+	if ((s = dev_block_get (o->dev = dev, 8192, size, DEV_PULL)) == NULL) {
+		ufs1_sb_fini (o);
+		return ufs1_sb_error (o, "Cannot read super block");
+	}
+
+	ok = ufs1_sb_parse (o, s);
+	dev_block_put (s, size);  /* before device is closed */
+
+	if (!ok) {
+		ufs1_sb_fini (o);
+		return 0;
+	}
+
+	dev_block_set_unit (dev, o->bshift);
+	return 1;
+}
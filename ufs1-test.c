@@ -9,6 +9,7 @@
 #include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <sys/param.h>
 #include <fcntl.h>
@@ -21,35 +22,14 @@
 
 #include "ufs1-inode.h"
 
-static void *
-ufs1_inode_dir_pull (const struct ufs1_cg *c, const struct ufs1_inode *o,
-		     uint64_t frag)
-{
-	const uint64_t head  = (frag + 0) * UFS1_DFSIZE;
-	const uint64_t next  = (frag + 1) * UFS1_DFSIZE;
-	const uint32_t block = head >> c->sb->bshift;
-	const uint32_t offs  = head & ~(~0 << c->sb->bshift);
-	off_t pos;
-
-	if (next > o->i_size)
-		return NULL;
-
-	if (block >= ARRAY_SIZE (o->i_db))
-		return NULL;  /* indirect blocks not supported yet */
-
-	pos = ((off_t) o->i_db[block] << c->sb->fshift) + offs;
-
-	return dev_block_get (c->sb->dev, pos, UFS1_DFSIZE, 1);
-}
-
-static void ufs1_dirent_show (const struct ufs1_dirent *o)
+static void ufs1_dirent_show (const struct ufs1_dirent *o, FILE *to)
 {
 	if (o->d_ino != 0 && o->d_namlen > 0)
-		fprintf (stderr, "I:          %2d: %.*s\n",
+		fprintf (to, "I:          %2d: %.*s\n",
 			 o->d_ino, o->d_namlen, o->d_name);
 }
 
-static void ufs1_dirent_show_frag (const void *frag)
+static void ufs1_dirent_show_frag (const void *frag, FILE *to)
 {
 	const void *p, *end;
 
@@ -58,18 +38,22 @@ static void ufs1_dirent_show_frag (const void *frag)
 		ufs1_dirent_valid (p, end - p);
 		p = ufs1_dirent_next (p)
 	)
-		ufs1_dirent_show (p);
+		ufs1_dirent_show (p, to);
 }
 
-static void ufs1_dir_show (const struct ufs1_cg *c, const struct ufs1_inode *o)
+static void
+ufs1_dir_show (const struct ufs1_cg *c, const struct ufs1_inode *o, FILE *to)
 {
-	uint64_t i;
-	void *p;
+	char frag[UFS1_DFSIZE];
+	off_t pos;
 
-	for (i = 0; (p = ufs1_inode_dir_pull (c, o, i)) != NULL; ++i) {
-		ufs1_dirent_show_frag (p);
-		dev_block_put (p, UFS1_DFSIZE);
-	}
+	for (
+		pos = 0;
+		ufs1_file_read (c->sb, o, pos, frag, sizeof (frag)) ==
+		sizeof (frag);
+		pos += sizeof (frag)
+	)
+		ufs1_dirent_show_frag (frag, to);
 }
 
 static void ufs1_show_mode (unsigned mode, FILE *to)
@@ -95,8 +79,8 @@ static void ufs1_show_mode (unsigned mode, FILE *to)
 	fputc (mode & 0001 ? svtx ? 't' : 'x' : svtx ? 'T' : '-', to);
 }
 
-static void
-ufs1_inode_show_blocks (const struct ufs1_cg *c, const struct ufs1_inode *o)
+static void ufs1_inode_show_blocks (const struct ufs1_cg *c,
+				    const struct ufs1_inode *o, FILE *to)
 {
 	const uint64_t count  = howmany (o->i_size, 1u << c->sb->bshift);
 	const size_t count_l1 = MIN (ARRAY_SIZE (o->i_db), count);
@@ -105,74 +89,65 @@ ufs1_inode_show_blocks (const struct ufs1_cg *c, const struct ufs1_inode *o)
 	if (o->i_size == 0)
 		return;
 
-	fprintf (stderr, " at %d", o->i_db[0]);
+	fprintf (to, " at %d", o->i_db[0]);
 
 	for (i = 1; i < count_l1; ++i)
-		fprintf (stderr, ", %d", o->i_db[i]);
+		fprintf (to, ", %d", o->i_db[i]);
 
 	if (count > count_l1)
-		fprintf (stderr, ", ...");
+		fprintf (to, ", ...");
 }
 
-static
-void ufs1_inode_show_link (const struct ufs1_cg *c, const struct ufs1_inode *o)
+static void ufs1_inode_show_link (const struct ufs1_cg *c,
+				  const struct ufs1_inode *o, FILE *to)
 {
 	if (o->i_size < 60 && o->i_content[o->i_size] == '\0')
-		fprintf (stderr, " -> %s\n", o->i_content);
+		fprintf (to, " -> %s\n", o->i_content);
 	else
-		ufs1_inode_show_blocks (c, o);
+		ufs1_inode_show_blocks (c, o, to);
 }
 
-static
-void ufs1_inode_show_rdev (const struct ufs1_cg *c, const struct ufs1_inode *o)
+static void ufs1_inode_show_rdev (const struct ufs1_cg *c,
+				  const struct ufs1_inode *o, FILE *to)
 {
-	fprintf (stderr, " -> %u, %u\n",
+	fprintf (to, " -> %u, %u\n",
 		 ufs1_major (o->i_rdev), ufs1_minor (o->i_rdev));
 }
 
-static
-void ufs1_inode_show_data (const struct ufs1_cg *c, const struct ufs1_inode *o)
+static void ufs1_inode_show_data (const struct ufs1_cg *c,
+				  const struct ufs1_inode *o, FILE *to)
 {
 	switch (IFTODT (o->i_mode)) {
-	case DT_LNK:	ufs1_inode_show_link   (c, o); break;
+	case DT_LNK:	ufs1_inode_show_link   (c, o, to); break;
 	case DT_CHR:
-	case DT_BLK:	ufs1_inode_show_rdev   (c, o); break;
-	default:	ufs1_inode_show_blocks (c, o); break;
+	case DT_BLK:	ufs1_inode_show_rdev   (c, o, to); break;
+	default:	ufs1_inode_show_blocks (c, o, to); break;
 	}
 
-	fputc ('\n', stderr);
+	fputc ('\n', to);
 
 	if (IFTODT (o->i_mode) == DT_DIR)
-		ufs1_dir_show (c, o);
+		ufs1_dir_show (c, o, to);
 }
 
-static int ufs1_cg_inode_show (const struct ufs1_cg *c, int n)
+static void ufs1_cg_inode_show (const struct ufs1_cg *c, int n,
+				const struct ufs1_inode *o, FILE *to)
 {
-	struct ufs1_inode *o;
-
-	if (!isset (ufs1_cg_imap (c), n))
-		return 1;
-
-	if ((o = ufs1_cg_inode_get (c, n, 1)) == NULL)
-		return 0;
-
-	fprintf (stderr, "I:     %2d: ", ufs1_cg_ino (c, n));
-	ufs1_show_mode (o->i_mode, stderr);
+	fprintf (to, "I:     %2d: ", ufs1_cg_ino (c, n));
+	ufs1_show_mode (o->i_mode, to);
 
-	fprintf (stderr, " %3d %4u %4u %8llu, %3u sectors",
+	fprintf (to, " %3d %4u %4u %8llu, %3u sectors",
 		 o->i_nlink, o->i_uid, o->i_gid,
 		 (unsigned long long) o->i_size, o->i_blocks);
-	ufs1_inode_show_data (c, o);
-	ufs1_inode_put (o);
-	return 1;
+	ufs1_inode_show_data (c, o, to);
 }
 
-static void ufs1_show_stat (const struct ufs1_cs *o)
+static void ufs1_show_stat (const struct ufs1_cs *o, FILE *to)
 {
-	fprintf (stderr, "I:     directories = %d\n", o->cs_ndir);
-	fprintf (stderr, "I:     free blocks = %d\n", o->cs_nbfree);
-	fprintf (stderr, "I:     free inodes = %d\n", o->cs_nifree);
-	fprintf (stderr, "I:     free frags  = %d\n", o->cs_nffree);
+	fprintf (to, "I:     directories = %d\n", o->cs_ndir);
+	fprintf (to, "I:     free blocks = %d\n", o->cs_nbfree);
+	fprintf (to, "I:     free inodes = %d\n", o->cs_nifree);
+	fprintf (to, "I:     free frags  = %d\n", o->cs_nffree);
 }
 
 static void ufs1_sb_show (const struct ufs1_sb *o)
@@ -180,67 +155,119 @@ static void ufs1_sb_show (const struct ufs1_sb *o)
 	fprintf (stderr, "N: Valid UFS1 super block found\n");
 	fprintf (stderr, "I:     block size  = %d\n", 1 << o->bshift);
 	fprintf (stderr, "I:     frag size   = %d\n", 1 << o->fshift);
-	ufs1_show_stat (&o->stat);
+	ufs1_show_stat (&o->stat, stderr);
 }
 
-static int ufs_cg_show (const struct ufs1_cg *o)
+static int ufs_cg_show (const struct ufs1_cg *o, FILE *to)
 {
-	int ok = 1, i;
+	const off_t itab = (off_t) ufs1_cg_iblkno (o->sb, o->cgx) << o->sb->fshift;
+	struct ufs1_inode_scan scan;
+	struct ufs1_inode *in;
 
-	fprintf (stderr, "N: Valid UFS1 cylinder group %u found\n", o->cgx);
-	ufs1_show_stat (&o->stat);
+	dev_block_advise (o->sb->dev, itab, o->ipg * sizeof (struct ufs1_inode),
+			  DEV_ADV_SEQ);
 
-	fprintf (stderr, "I: List of i-nodes:\n");
+	fprintf (to, "N: Valid UFS1 cylinder group %u found\n", o->cgx);
+	ufs1_show_stat (&o->stat, to);
 
-	for (i = 0; i < o->ipg; ++i)
-		if (!ufs1_cg_inode_show (o, i)) {
-			fprintf (stderr, "E: Cannot read inode %u\n",
-				 ufs1_cg_ino (o, i));
-			ok = 0;
-			continue;
-		}
+	fprintf (to, "I: List of i-nodes:\n");
 
-	return ok;
+	ufs1_inode_scan_init (&scan, o);
+
+	while ((in = ufs1_inode_scan_next (&scan)) != NULL)
+		ufs1_cg_inode_show (o, scan.n, in, to);
+
+	ufs1_inode_scan_fini (&scan);
+
+	if (!scan.ok)
+		fprintf (to, "E: Cannot read inode %u\n",
+			 ufs1_cg_ino (o, scan.next));
+
+	return scan.ok;
 }
 
-static int ufs1_fs_show (struct ufs1_sb *sb)
+/*
+ * Groups are shown in parallel into memory streams, and the reports are
+ * printed in order of groups, thus output does not depend on scheduling
+ */
+struct ufs1_report {
+	char	*text;
+	size_t	size;
+	int	ok;
+};
+
+static void *
+ufs1_cg_report (void *cookie, uint32_t cgx, const struct ufs1_cg *c)
 {
-	int ok = 1;
-	uint32_t i;
-	struct ufs1_cg c;
+	struct ufs1_report *o;
+	FILE *to;
 
-	ufs1_sb_show (sb);
+	if ((o = calloc (1, sizeof (*o))) == NULL)
+		return NULL;
 
-	for (i = 0; i < sb->ncg; ++i) {
-		if (!ufs1_cg_init (&c, sb, i)) {
-			fprintf (stderr, "E: Cannot find valid UFS1 "
-					 "cylinder group %u\n", i);
-			ok = 0;
-			continue;
-		}
+	if ((to = open_memstream (&o->text, &o->size)) == NULL) {
+		free (o);
+		return NULL;
+	}
+
+	if (c == NULL)
+		fprintf (to, "E: Cannot find valid UFS1 cylinder group %u\n",
+			 cgx);
+	else
+		o->ok = ufs_cg_show (c, to);
 
-		ok &= ufs_cg_show (&c);
-		ufs1_cg_fini (&c);
+	fclose (to);
+	return o;
+}
+
+static void ufs1_cg_print (void *cookie, uint32_t cgx, void *result)
+{
+	struct ufs1_report *o = result;
+	int *ok = cookie;
+
+	if (o == NULL) {
+		fprintf (stderr, "E: Cannot show UFS1 cylinder group %u\n", cgx);
+		*ok = 0;
+		return;
 	}
 
-	return ok;
+	fwrite (o->text, 1, o->size, stderr);
+	*ok &= o->ok;
+
+	free (o->text);
+	free (o);
+}
+
+static int ufs1_fs_show (struct ufs1_sb *sb)
+{
+	int ok = 1;
+
+	ufs1_sb_show (sb);
+
+	return ufs1_cg_visit (sb, 0, ufs1_cg_report, ufs1_cg_print, &ok) && ok;
 }
 
 int main (int argc, char *argv[])
 {
+	const char *opt  = argc == 3 ? argv[1] : "";
+	const char *path = argv[argc - 1];
+	const int mode = strcmp (opt, "-d") == 0 ? DEV_DIRECT :
+			 strcmp (opt, "-m") == 0 ? DEV_MMAP : 0;
 	int fd, ok;
 	struct ufs1_sb s;
 
-	if (argc != 2) {
-		fprintf (stderr, "usage:\n\tufs1-test <ufs1-image>\n");
+	if (argc != 2 && mode == 0) {
+		fprintf (stderr, "usage:\n\tufs1-test [-d | -m] <ufs1-image>\n");
 		return 1;
 	}
 
-	if ((fd = open (argv[1], O_RDONLY)) == -1) {
-		perror (argv[1]);
+	if ((fd = dev_block_open (path, mode)) == -1) {
+		perror (path);
 		return 1;
 	}
 
+	dev_block_advise (fd, 0, 0, DEV_ADV_RANDOM);
+
 	if (!ufs1_sb_init (&s, fd)) {
 		fprintf (stderr, "E: Cannot find valid UFS1 super block\n");
 		return 1;